@@ -0,0 +1,54 @@
+// bench-server.cpp: server for load tests, with the event engine selectable
+//   usage: bench-server [PORT [poll|epoll|kqueue|io_uring [CAPTURE_FILE]]]
+// With CAPTURE_FILE, the received traffic is recorded for modbus-replay.
+
+#include <string>
+#include "komob.hpp"
+
+
+class MemoryRegisterTable: public komob::RegisterTable {
+  public:
+    MemoryRegisterTable(unsigned size=1024): registers(size, 0) {}
+    bool read(unsigned address, unsigned & value) override {
+        if (address >= registers.size()) {
+            return false;
+        }
+        value = registers[address];
+        return true;
+    }
+    bool write(unsigned address, unsigned value) override {
+        if (address >= registers.size()) {
+            return false;
+        }
+        registers[address] = value;
+        return true;
+    }
+  private:
+    std::vector<unsigned> registers;
+};
+
+
+
+int main(int argc, char** argv)
+{
+    komob::Server server(std::make_shared<MemoryRegisterTable>());
+    
+    std::string engine = (argc >= 3) ? argv[2] : "";
+    if (engine == "poll") {
+        server.set_event_backend(komob::EventBackend::Poll);
+    }
+    else if (engine == "epoll") {
+        server.set_event_backend(komob::EventBackend::Epoll);
+    }
+    else if (engine == "kqueue") {
+        server.set_event_backend(komob::EventBackend::Kqueue);
+    }
+    else if (engine == "io_uring") {
+        server.set_event_backend(komob::EventBackend::IoUring);
+    }
+    if (argc >= 4) {
+        server.set_capture(std::make_shared<komob::TrafficCapture>(argv[3]));
+    }
+    
+    return server.run(argc, argv);
+}
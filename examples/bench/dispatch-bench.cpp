@@ -0,0 +1,139 @@
+// dispatch-bench.cpp: microbenchmarks of the request handling, without the network
+//   usage: dispatch-bench [ITERATIONS]
+// Requests go to the last table of a chain of 1, 5 or 20 tables, each owning 64 registers,
+// with and without declared address ranges, in both data-width modes;
+// then the same requests to a compile-time map (StaticRegisterTable) on a plain array.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "komob.hpp"
+
+
+class MemoryRegisterTable: public komob::RegisterTable {
+  public:
+    MemoryRegisterTable(unsigned start, unsigned size): start(start), registers(size, 0) {}
+    bool read(unsigned address, unsigned & value) override {
+        if ((address < start) || (address - start >= registers.size())) {
+            return false;
+        }
+        value = registers[address - start];
+        return true;
+    }
+    bool write(unsigned address, unsigned value) override {
+        if ((address < start) || (address - start >= registers.size())) {
+            return false;
+        }
+        registers[address - start] = value;
+        return true;
+    }
+  private:
+    unsigned start;
+    std::vector<unsigned> registers;
+};
+
+
+struct Block {
+    unsigned registers[64];
+};
+
+
+struct Request {
+    const char* name;
+    std::vector<uint8_t> pdu;
+};
+
+
+static std::vector<uint8_t> read_pdu(unsigned start, unsigned quantity)
+{
+    return { 0x03, uint8_t(start >> 8), uint8_t(start), uint8_t(quantity >> 8), uint8_t(quantity) };
+}
+
+
+static void measure(komob::Server& server, const Request& request, unsigned long iterations, const char* label)
+{
+    uint8_t response[komob::Server::MAX_RESPONSE_PDU_SIZE];
+    if ((server.dispatch(request.pdu.data(), request.pdu.size(), response) < 2) || (response[0] & 0x80)) {
+        std::fprintf(stderr, "%s: exception response\n", request.name);
+        std::exit(-1);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long n = 0; n < iterations; n++) {
+        server.dispatch(request.pdu.data(), request.pdu.size(), response);
+        asm volatile("" : : "r"(response) : "memory");  // keep the response alive
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%s %-22s %10.1f\n", label, request.name, 1e9 * elapsed / iterations);
+}
+
+
+static std::vector<uint8_t> write_pdu(unsigned start, unsigned quantity)
+{
+    std::vector<uint8_t> pdu = { 0x10, uint8_t(start >> 8), uint8_t(start), uint8_t(quantity >> 8), uint8_t(quantity), uint8_t(2 * quantity) };
+    for (unsigned i = 0; i < quantity; i++) {
+        pdu.push_back(0);
+        pdu.push_back(uint8_t(i));
+    }
+    return pdu;
+}
+
+
+int main(int argc, char** argv)
+{
+    unsigned long iterations = (argc >= 2) ? std::stoul(argv[1]) : 1000000;
+    
+    std::printf("%-6s %-7s %-7s %-22s %10s\n", "width", "tables", "ranges", "request", "ns/request");
+    for (auto width: { komob::DataWidth::W16, komob::DataWidth::W32 }) {
+        for (unsigned tables: { 1, 5, 20 }) {
+            for (bool ranges: { false, true }) {
+                komob::Server server(nullptr, width);
+                for (unsigned i = 0; i < tables; i++) {
+                    auto table = std::make_shared<MemoryRegisterTable>(64 * i, 64);
+                    if (ranges) {
+                        server.add(table, {{64 * i, 64}});
+                    }
+                    else {
+                        server.add(table);
+                    }
+                }
+                // the quantities count 16-bit words; 32-bit mode reads half as many registers
+                unsigned last = 64 * (tables - 1);
+                std::vector<Request> requests = {
+                    { "read 2 words", read_pdu(last, 2) },
+                    { "read 64 words", read_pdu(last, 64) },
+                    { "write 16 words", write_pdu(last, 16) },
+                };
+                
+                char label[64];
+                std::snprintf(
+                    label, sizeof(label), "%-6s %-7u %-7s",
+                    (width == komob::DataWidth::W16) ? "16bit" : "32bit", tables, ranges ? "yes" : "no"
+                );
+                for (const auto& request: requests) {
+                    measure(server, request, iterations, label);
+                }
+            }
+        }
+    }
+    
+    for (auto width: { komob::DataWidth::W16, komob::DataWidth::W32 }) {
+        Block block{};
+        using BlockTable = komob::StaticRegisterTable<Block, komob::RegisterArray<0, &Block::registers>>;
+        auto table = std::make_shared<BlockTable>(block);
+        komob::Server server(nullptr, width);
+        server.add(table, table->ranges());
+        std::vector<Request> requests = {
+            { "read 2 words", read_pdu(0, 2) },
+            { "read 64 words", read_pdu(0, 64) },
+            { "write 16 words", write_pdu(0, 16) },
+        };
+        for (const auto& request: requests) {
+            measure(server, request, iterations, (width == komob::DataWidth::W16) ? "16bit  static  yes    " : "32bit  static  yes    ");
+        }
+    }
+    
+    return 0;
+}
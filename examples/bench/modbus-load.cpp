@@ -0,0 +1,146 @@
+// modbus-load.cpp: closed-loop Modbus/TCP load generator
+//   usage: modbus-load [HOST [PORT [CONNECTIONS [SECONDS [QUANTITY]]]]]
+// Each connection sends one Read Holding Registers request and waits for the reply before the next one;
+// the throughput and the latency percentiles are reported at the end.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+using Clock = std::chrono::steady_clock;
+
+
+struct Client {
+    int fd;
+    uint16_t transaction_id = 0;
+    uint8_t request[12];
+    std::vector<uint8_t> response;
+    size_t expected = 0, received = 0;
+    Clock::time_point sent_at;
+};
+
+
+static void send_request(Client& client, unsigned quantity)
+{
+    uint8_t* p = client.request;
+    client.transaction_id++;
+    p[0] = client.transaction_id >> 8; p[1] = client.transaction_id & 0xff;
+    p[2] = 0; p[3] = 0;      // protocol
+    p[4] = 0; p[5] = 6;      // length
+    p[6] = 1;                // unit
+    p[7] = 0x03;             // Read Holding Registers from address 0
+    p[8] = 0; p[9] = 0;
+    p[10] = quantity >> 8; p[11] = quantity & 0xff;
+    
+    client.expected = 7 + 2 + 2 * quantity;
+    client.received = 0;
+    client.sent_at = Clock::now();
+    if (::send(client.fd, client.request, sizeof(client.request), MSG_NOSIGNAL) != sizeof(client.request)) {
+        throw std::runtime_error("send() failed");
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    std::string host = (argc >= 2) ? argv[1] : "127.0.0.1";
+    unsigned port = (argc >= 3) ? std::stoi(argv[2]) : 502;
+    unsigned connections = (argc >= 4) ? std::stoi(argv[3]) : 8;
+    double seconds = (argc >= 5) ? std::stod(argv[4]) : 5;
+    unsigned quantity = (argc >= 6) ? std::stoi(argv[5]) : 2;
+    
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        std::cerr << "bad address: " << host << std::endl;
+        return -1;
+    }
+
+    std::vector<Client> clients(connections);
+    std::vector<pollfd> pollfd_list;
+    for (auto& client: clients) {
+        client.fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (::connect(client.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            std::cerr << "connect() failed" << std::endl;
+            return -1;
+        }
+        int yes = 1;
+        ::setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        client.response.resize(7 + 2 + 2 * quantity);
+        pollfd_list.push_back(pollfd{client.fd, POLLIN, 0});
+    }
+
+    uint64_t count = 0;
+    double total_latency = 0;
+    std::vector<uint32_t> latencies_ns;  // every request, for the percentiles
+    latencies_ns.reserve(1 << 20);
+    auto start = Clock::now();
+    auto stop = start + std::chrono::duration<double>(seconds);
+    for (auto& client: clients) {
+        send_request(client, quantity);
+    }
+    
+    while (Clock::now() < stop) {
+        if (::poll(pollfd_list.data(), pollfd_list.size(), 1000) < 0) {
+            std::cerr << "poll() failed" << std::endl;
+            return -1;
+        }
+        for (size_t i = 0; i < clients.size(); i++) {
+            if (! (pollfd_list[i].revents & POLLIN)) {
+                continue;
+            }
+            Client& client = clients[i];
+            ssize_t n = ::recv(client.fd, client.response.data() + client.received, client.expected - client.received, 0);
+            if (n <= 0) {
+                std::cerr << "connection closed by the server" << std::endl;
+                return -1;
+            }
+            client.received += n;
+            if (client.received < client.expected) {
+                continue;
+            }
+            auto now = Clock::now();
+            double latency = std::chrono::duration<double>(now - client.sent_at).count();
+            total_latency += latency;
+            latencies_ns.push_back(static_cast<uint32_t>(std::min(1e9 * latency, 4e9)));
+            count++;
+            send_request(client, quantity);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    
+    std::cout << "connections: " << connections << ", registers/request: " << quantity << std::endl;
+    std::cout << "requests: " << count << " in " << elapsed << " s" << std::endl;
+    std::cout << "throughput: " << count / elapsed << " req/s" << std::endl;
+    std::cout << "mean latency: " << (count ? 1e6 * total_latency / count : 0) << " us" << std::endl;
+    if (! latencies_ns.empty()) {
+        std::sort(latencies_ns.begin(), latencies_ns.end());
+        auto percentile = [&](double fraction) {
+            size_t index = static_cast<size_t>(fraction * static_cast<double>(latencies_ns.size() - 1) + 0.5);
+            return 1e-3 * latencies_ns[index];
+        };
+        std::cout << "latency p50 / p99 / p999 / max: ";
+        std::cout << percentile(0.5) << " / " << percentile(0.99) << " / " << percentile(0.999) << " / ";
+        std::cout << 1e-3 * latencies_ns.back() << " us" << std::endl;
+    }
+
+    for (auto& client: clients) {
+        ::close(client.fd);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,378 @@
+// modbus-replay.cpp: replays captured client traffic into a Server in-process, without sockets
+//   usage: modbus-replay CAPTURE [PASSES [MUTATED_PERCENT [16|32 [PCAP_PORT]]]]
+// CAPTURE is a file recorded by Server::set_capture() (bench-server CAPTURE_FILE), or a classic pcap
+// of the traffic to PCAP_PORT (502 by default). Every received chunk is fed to a Server::Session of its stream,
+// as the server got it; MUTATED_PERCENT of the chunks get one random byte changed, for malformed frames.
+// The time and the heap allocations of each feed are reported by function code of the response.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include "komob.hpp"
+
+
+// heap allocations while counting, by the replaced allocation functions (all the forms of operator new)
+static bool counting = false;
+static uint64_t allocations = 0;
+
+// out of line, so that the compiler does not pair the operator new of a caller with free()
+[[gnu::noinline]] static void* allocate(size_t size, size_t alignment) noexcept
+{
+    allocations += counting;
+    size = size ? size : 1;
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        return std::malloc(size);
+    }
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+[[gnu::noinline]] static void release(void* p) noexcept
+{
+    std::free(p);
+}
+
+static void* allocate_or_throw(size_t size, size_t alignment)
+{
+    if (void* p = allocate(size, alignment)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size) { return allocate_or_throw(size, 0); }
+void* operator new[](size_t size) { return allocate_or_throw(size, 0); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocate(size, 0); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocate(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) { return allocate_or_throw(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return allocate_or_throw(size, static_cast<size_t>(alignment)); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocate(size, static_cast<size_t>(alignment)); }
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, size_t) noexcept { release(p); }
+void operator delete[](void* p, size_t) noexcept { release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+
+
+class MemoryRegisterTable: public komob::RegisterTable {
+  public:
+    MemoryRegisterTable(unsigned size=65536): registers(size, 0) {}
+    bool read(unsigned address, unsigned & value) override {
+        if (address >= registers.size()) {
+            return false;
+        }
+        value = registers[address];
+        return true;
+    }
+    bool write(unsigned address, unsigned value) override {
+        if (address >= registers.size()) {
+            return false;
+        }
+        registers[address] = value;
+        return true;
+    }
+  private:
+    std::vector<unsigned> registers;
+};
+
+
+struct Record {
+    uint32_t stream;
+    std::vector<uint8_t> bytes;  // empty: the end of the stream
+};
+
+
+static uint32_t get_u32(const uint8_t* p, bool big_endian)
+{
+    return big_endian ? (uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3]) : (uint32_t(p[3]) << 24 | uint32_t(p[2]) << 16 | uint32_t(p[1]) << 8 | p[0]);
+}
+
+
+static unsigned get_u16(const uint8_t* p)
+{
+    return unsigned(p[0]) << 8 | p[1];
+}
+
+
+static std::vector<Record> read_capture(const std::vector<uint8_t>& file)
+{
+    std::vector<Record> records;
+    size_t offset = 8;  // "KOMOBCAP"
+    while (offset + 14 <= file.size()) {
+        const uint8_t* header = &file[offset];
+        size_t length = get_u16(header + 12);
+        if (offset + 14 + length > file.size()) {
+            break;  // cut short while recording
+        }
+        records.push_back({ get_u32(header + 8, true), std::vector<uint8_t>(header + 14, header + 14 + length) });
+        offset += 14 + length;
+    }
+    return records;
+}
+
+
+// TCP payloads to the server port, in sequence order: retransmissions are dropped, a gap is skipped over
+static std::vector<Record> read_pcap(const std::vector<uint8_t>& file, unsigned port)
+{
+    bool big_endian = (file[0] == 0xa1);
+    uint32_t link_type = get_u32(&file[20], big_endian);
+    struct Stream {
+        uint32_t id;
+        uint32_t next_seq;
+        bool synchronized;
+    };
+    std::map<std::string, Stream> streams;
+    uint32_t last_id = 0;
+    std::vector<Record> records;
+
+    size_t offset = 24;
+    while (offset + 16 <= file.size()) {
+        size_t captured = get_u32(&file[offset + 8], big_endian);
+        const uint8_t* packet = &file[offset + 16];
+        offset += 16 + captured;
+        if (offset > file.size()) {
+            break;
+        }
+
+        // link layer -> IP
+        const uint8_t* ip = packet;
+        size_t size = captured;
+        unsigned ethertype = 0;
+        if (link_type == 1 && size >= 14) {            // Ethernet, with an optional VLAN tag
+            ethertype = get_u16(packet + 12);
+            ip += 14, size -= 14;
+            if (ethertype == 0x8100 && size >= 4) {
+                ethertype = get_u16(ip + 2);
+                ip += 4, size -= 4;
+            }
+        }
+        else if (link_type == 113 && size >= 16) {     // Linux cooked capture
+            ethertype = get_u16(packet + 14);
+            ip += 16, size -= 16;
+        }
+        else if (link_type == 276 && size >= 20) {     // Linux cooked capture v2
+            ethertype = get_u16(packet);
+            ip += 20, size -= 20;
+        }
+        else if (link_type == 0 && size >= 4) {        // BSD loopback
+            ip += 4, size -= 4;
+            ethertype = (size > 0 && (ip[0] >> 4) == 6) ? 0x86dd : 0x0800;
+        }
+        else if (link_type == 101 && size >= 1) {      // raw IP
+            ethertype = ((ip[0] >> 4) == 6) ? 0x86dd : 0x0800;
+        }
+
+        // IP -> TCP; the stream key is the addresses and the ports
+        const uint8_t* tcp;
+        std::string key;
+        if (ethertype == 0x0800 && size >= 20 && ip[9] == 6) {
+            size_t header_length = (ip[0] & 0x0f) * 4;
+            size = std::min<size_t>(size, get_u16(ip + 2));
+            if (size < header_length) {
+                continue;
+            }
+            key.assign(reinterpret_cast<const char*>(ip + 12), 8);
+            tcp = ip + header_length;
+            size -= header_length;
+        }
+        else if (ethertype == 0x86dd && size >= 40 && ip[6] == 6) {  // no extension headers
+            size = std::min<size_t>(size - 40, get_u16(ip + 4));
+            key.assign(reinterpret_cast<const char*>(ip + 8), 32);
+            tcp = ip + 40;
+        }
+        else {
+            continue;
+        }
+        if (size < 20 || get_u16(tcp + 2) != port) {
+            continue;
+        }
+        key.append(reinterpret_cast<const char*>(tcp), 4);
+        size_t header_length = (tcp[12] >> 4) * 4;
+        if (size < header_length) {
+            continue;
+        }
+        uint32_t seq = get_u32(tcp + 4, true);
+        uint8_t flags = tcp[13];
+        const uint8_t* payload = tcp + header_length;
+        size_t payload_size = size - header_length;
+
+        auto found = streams.find(key);
+        if (flags & 0x02) {  // SYN: a new connection
+            if (found != streams.end()) {
+                records.push_back({ found->second.id, {} });
+            }
+            streams[key] = { ++last_id, seq + 1, true };
+            continue;
+        }
+        if (found == streams.end()) {
+            if (payload_size == 0) {
+                continue;
+            }
+            found = streams.emplace(key, Stream{ ++last_id, seq, true }).first;  // captured while connected
+        }
+        Stream& stream = found->second;
+        int32_t ahead = static_cast<int32_t>(seq - stream.next_seq);
+        if (ahead < 0) {  // retransmitted, possibly with new bytes at the end
+            size_t seen = static_cast<size_t>(-int64_t(ahead));
+            payload += std::min(seen, payload_size);
+            payload_size -= std::min(seen, payload_size);
+        }
+        if (payload_size > 0) {
+            records.push_back({ stream.id, std::vector<uint8_t>(payload, payload + payload_size) });
+            stream.next_seq = seq + static_cast<uint32_t>(size - header_length);
+        }
+        if (flags & 0x05) {  // FIN or RST
+            records.push_back({ stream.id, {} });
+            streams.erase(found);
+        }
+    }
+    return records;
+}
+
+
+// feeds by the function code of the response, or by what happened to the chunk
+struct Row {
+    uint64_t requests = 0, exceptions = 0, allocations = 0;
+    double total_ns = 0;
+    komob::ServerStats latency;
+};
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s CAPTURE [PASSES [MUTATED_PERCENT [16|32 [PCAP_PORT]]]]\n", argv[0]);
+        return -1;
+    }
+    unsigned passes = (argc >= 3) ? std::stoul(argv[2]) : 10;
+    double mutated = (argc >= 4) ? std::stod(argv[3]) / 100 : 0;
+    bool w16 = (argc >= 5) && (std::string(argv[4]) == "16");
+    unsigned port = (argc >= 6) ? std::stoul(argv[5]) : 502;
+
+    std::ifstream input(argv[1], std::ios::binary);
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    std::vector<Record> records;
+    if (file.size() >= 8 && std::memcmp(file.data(), "KOMOBCAP", 8) == 0) {
+        records = read_capture(file);
+    }
+    else if (file.size() >= 24 && (get_u32(file.data(), true) == 0xa1b2c3d4 || get_u32(file.data(), false) == 0xa1b2c3d4 || get_u32(file.data(), true) == 0xa1b23c4d || get_u32(file.data(), false) == 0xa1b23c4d)) {
+        records = read_pcap(file, port);
+    }
+    else {
+        std::fprintf(stderr, "%s: neither a komob capture nor a pcap file (pcapng is to be converted with editcap -F pcap)\n", argv[1]);
+        return -1;
+    }
+
+    komob::Server server(std::make_shared<MemoryRegisterTable>(), w16 ? komob::DataWidth::W16 : komob::DataWidth::W32);
+    std::vector<Row> rows(256 + 3);
+    const unsigned PIPELINED = 256, INCOMPLETE = 257, BROKEN = 258;  // chunks of several responses, of none, of a broken stream
+    std::vector<uint8_t> responses, mutation;
+    responses.reserve(1 << 22);  // enough for the responses to the smallest frames of the largest record
+    mutation.reserve(1 << 16);
+    std::mt19937 random(1);
+    uint64_t chunks = 0, streams = 0, broken = 0;
+    double total_ns = 0;
+
+    for (unsigned pass = 0; pass < passes; pass++) {
+        std::map<uint32_t, std::unique_ptr<komob::Server::Session>> sessions;
+        for (const auto& record: records) {
+            auto& session = sessions[record.stream];
+            if (record.bytes.empty()) {
+                session.reset();
+                sessions.erase(record.stream);
+                continue;
+            }
+            if (! session) {
+                session = std::make_unique<komob::Server::Session>(server);
+                streams++;
+            }
+            const std::vector<uint8_t>* bytes = &record.bytes;
+            if ((mutated > 0) && (std::uniform_real_distribution<double>(0, 1)(random) < mutated)) {
+                mutation = record.bytes;
+                mutation[random() % mutation.size()] = static_cast<uint8_t>(random());
+                bytes = &mutation;
+            }
+
+            responses.clear();
+            counting = true;
+            uint64_t allocations_before = allocations;
+            auto start = std::chrono::steady_clock::now();
+            bool ok = session->feed(bytes->data(), bytes->size(), responses);
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            counting = false;
+
+            // the responses: [MBAP (7)][Function Code]...
+            unsigned count = 0, exceptions = 0, function_code = 0;
+            for (size_t offset = 0; offset + 8 <= responses.size(); offset += 6 + get_u16(&responses[offset + 4])) {
+                function_code = responses[offset + 7] & 0x7f;
+                exceptions += (responses[offset + 7] & 0x80) ? 1 : 0;
+                count++;
+            }
+            Row& row = rows[! ok ? BROKEN : (count == 0) ? INCOMPLETE : (count > 1) ? PIPELINED : function_code];
+            uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            row.requests += count;
+            row.exceptions += exceptions;
+            row.allocations += allocations - allocations_before;
+            row.total_ns += ns;
+            row.latency.latency_histogram[komob::ServerStats::latency_bucket(ns)]++;
+            row.latency.latency_max_ns = std::max(row.latency.latency_max_ns, ns);
+            total_ns += ns;
+            chunks++;
+            broken += ! ok;
+        }
+    }
+
+    uint64_t requests = 0, total_allocations = 0;
+    for (const auto& row: rows) {
+        requests += row.requests;
+        total_allocations += row.allocations;
+    }
+    std::printf("%llu records, %u passes: %llu streams, %llu chunks, %llu requests, %llu broken streams\n",
+        (unsigned long long) records.size(), passes, (unsigned long long) streams, (unsigned long long) chunks,
+        (unsigned long long) requests, (unsigned long long) broken
+    );
+    std::printf("%.0f requests/s in feed(), %llu heap allocations\n\n",
+        (total_ns > 0) ? 1e9 * requests / total_ns : 0.0, (unsigned long long) total_allocations
+    );
+    std::printf("%-10s %9s %9s %10s %7s %9s %9s %9s %9s %9s\n",
+        "response", "chunks", "requests", "exceptions", "allocs", "mean ns", "p50 ns", "p99 ns", "p999 ns", "max ns"
+    );
+    for (unsigned i = 0; i < rows.size(); i++) {
+        const Row& row = rows[i];
+        uint64_t fed = 0;
+        for (uint64_t n: row.latency.latency_histogram) {
+            fed += n;
+        }
+        if (fed == 0) {
+            continue;
+        }
+        char name[16];
+        std::snprintf(name, sizeof(name), "FC 0x%02x", i);
+        std::printf("%-10s %9llu %9llu %10llu %7llu %9.0f %9llu %9llu %9llu %9llu\n",
+            (i == PIPELINED) ? "pipelined" : (i == INCOMPLETE) ? "incomplete" : (i == BROKEN) ? "broken" : name,
+            (unsigned long long) fed, (unsigned long long) row.requests, (unsigned long long) row.exceptions,
+            (unsigned long long) row.allocations, row.total_ns / fed,
+            (unsigned long long) row.latency.latency_percentile_ns(0.5), (unsigned long long) row.latency.latency_percentile_ns(0.99),
+            (unsigned long long) row.latency.latency_percentile_ns(0.999), (unsigned long long) row.latency.latency_max_ns
+        );
+    }
+
+    return 0;
+}
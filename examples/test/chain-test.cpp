@@ -0,0 +1,200 @@
+// chain-test.cpp: checks of the register chain and the request limits, through Server::dispatch() and RegisterChain,
+// without the network
+//   usage: chain-test
+// Prints each check and exits with a non-zero status if any fails.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+#include "komob.hpp"
+
+
+class MemoryRegisterTable: public komob::RegisterTable {
+  public:
+    MemoryRegisterTable(unsigned size=1024): registers(size, 0) {}
+    bool read(unsigned address, unsigned & value) override {
+        if (address >= registers.size()) {
+            return false;
+        }
+        value = registers[address];
+        return true;
+    }
+    bool write(unsigned address, unsigned value) override {
+        if (address >= registers.size()) {
+            return false;
+        }
+        registers[address] = value;
+        return true;
+    }
+    std::vector<unsigned> registers;
+};
+
+
+// a software register at one address, in front of the memory
+class VirtualRegisterTable: public komob::RegisterTable {
+  public:
+    VirtualRegisterTable(unsigned address, unsigned value): address(address), value(value) {}
+    bool read(unsigned a, unsigned & v) override {
+        if (a != address) {
+            return false;
+        }
+        v = value;
+        return true;
+    }
+  private:
+    unsigned address, value;
+};
+
+
+// refuses the writes to one address
+class GuardRegisterTable: public komob::RegisterTable {
+  public:
+    GuardRegisterTable(unsigned address): address(address) {}
+    bool write(unsigned a, unsigned /*value*/) override {
+        if (a == address) {
+            throw std::runtime_error("write protected");
+        }
+        return false;
+    }
+  private:
+    unsigned address;
+};
+
+
+// counts the reads, handles none
+class MonitorRegisterTable: public komob::RegisterTable {
+  public:
+    bool read(unsigned /*address*/, unsigned & /*value*/) override {
+        reads++;
+        return false;
+    }
+    unsigned reads = 0;
+};
+
+
+// takes every read, to complete it later
+class AsyncRegisterTable: public komob::RegisterTable {
+  public:
+    bool read_block_async(unsigned /*start*/, unsigned count, unsigned* values, komob::Completion completion) override {
+        std::fill_n(values, count, 0xa5);
+        pending = completion;
+        return true;
+    }
+    komob::Completion pending;
+};
+
+
+struct CompletionTarget: komob::Completion::Target {
+    void complete(bool succeeded) override {
+        completed = true;
+        success = succeeded;
+    }
+    bool completed = false, success = false;
+};
+
+
+static unsigned failures = 0;
+
+static void check(const char* name, bool ok)
+{
+    std::printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    failures += ok ? 0 : 1;
+}
+
+
+static std::vector<uint8_t> dispatch(komob::Server& server, std::vector<uint8_t> request)
+{
+    uint8_t response[komob::Server::MAX_RESPONSE_PDU_SIZE];
+    size_t size = server.dispatch(request.data(), request.size(), response);
+    return std::vector<uint8_t>(response, response + size);
+}
+
+
+static unsigned word(const std::vector<uint8_t>& response, unsigned index)
+{
+    return (response[2 + 2 * index] << 8) | response[3 + 2 * index];  // [FC][ByteCount][Data...]
+}
+
+
+int main()
+{
+    auto memory = std::make_shared<MemoryRegisterTable>();
+    for (unsigned i = 0; i < 10; i++) {
+        memory->registers[i] = 100 + i;
+    }
+    komob::Server server(nullptr, komob::DataWidth::W16);
+    server.add(std::make_shared<VirtualRegisterTable>(5, 1234));
+    server.add(std::make_shared<GuardRegisterTable>(5));
+    server.add(memory);
+
+    // sparse tables in front of a catch-all keep their addresses within blocks
+    auto single = dispatch(server, { 0x03, 0x00, 0x05, 0x00, 0x01 });
+    check("read of the virtual register alone", (single[0] == 0x03) && (word(single, 0) == 1234));
+    auto block = dispatch(server, { 0x03, 0x00, 0x00, 0x00, 0x0a });
+    check("read of a block over the virtual register", (block[0] == 0x03) && (word(block, 4) == 104) && (word(block, 5) == 1234) && (word(block, 6) == 106));
+    auto single_write = dispatch(server, { 0x06, 0x00, 0x05, 0x00, 0x07 });
+    check("write of the guarded register alone", (single_write[0] == 0x86) && (single_write[1] == 0x04));
+    std::vector<uint8_t> write = { 0x10, 0x00, 0x00, 0x00, 0x0a, 0x14 };
+    for (unsigned i = 0; i < 10; i++) {
+        write.push_back(0x00);
+        write.push_back(static_cast<uint8_t>(i));
+    }
+    auto block_write = dispatch(server, write);
+    check("write of a block over the guarded register", (block_write[0] == 0x90) && (block_write[1] == 0x04) && (memory->registers[5] == 105));
+
+    // with declared ranges, the route of a block skips the tables not owning it
+    komob::Server ranged(nullptr, komob::DataWidth::W16);
+    ranged.add(std::make_shared<VirtualRegisterTable>(5, 1234), {{5, 1}});
+    ranged.add(memory);
+    auto routed = dispatch(ranged, { 0x03, 0x00, 0x00, 0x00, 0x0a });
+    check("read of a block over a declared register", (routed[0] == 0x03) && (word(routed, 4) == memory->registers[4]) && (word(routed, 5) == 1234) && (word(routed, 6) == memory->registers[6]));
+    
+    // a table without ranges keeps its addresses within the route of a declared one
+    komob::Server mixed(nullptr, komob::DataWidth::W16);
+    mixed.add(std::make_shared<VirtualRegisterTable>(5, 1234));
+    mixed.add(memory, {{0, 1024}});
+    auto layered = dispatch(mixed, { 0x03, 0x00, 0x00, 0x00, 0x0a });
+    check("read of a block over a register without ranges", (layered[0] == 0x03) && (word(layered, 4) == memory->registers[4]) && (word(layered, 5) == 1234) && (word(layered, 6) == memory->registers[6]));
+
+    // the diagnostic registers refuse writes instead of passing them to the tables behind
+    komob::Server diagnosed(memory, komob::DataWidth::W16);
+    diagnosed.set_diagnostic_registers(500);
+    memory->registers[500] = 0;
+    auto refused = dispatch(diagnosed, { 0x06, 0x01, 0xf4, 0x12, 0x34 });
+    check("write of a diagnostic register", (refused[0] == 0x86) && (refused[1] == 0x02) && (memory->registers[500] == 0));
+    auto counter = dispatch(diagnosed, { 0x03, 0x01, 0xf4, 0x00, 0x01 });
+    check("read of a diagnostic register after the write", (counter[0] == 0x03) && (word(counter, 0) != 0x1234));
+
+    // quantities beyond the limits of the spec are refused, before the byte count would overflow
+    auto longest = dispatch(server, { 0x03, 0x00, 0x00, 0x00, 125 });
+    check("read of 125 registers", (longest[0] == 0x03) && (longest[1] == 250) && (longest.size() == 2 + 250));
+    auto too_long = dispatch(server, { 0x03, 0x00, 0x00, 0x00, 126 });
+    check("read of 126 registers", (too_long[0] == 0x83) && (too_long[1] == 0x03));
+    auto too_long_rw = dispatch(server, { 0x17, 0x00, 0x00, 0x00, 128, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00, 0x00 });
+    check("read/write reading 128 registers", (too_long_rw[0] == 0x97) && (too_long_rw[1] == 0x03));
+    auto empty_rw = dispatch(server, { 0x17, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 });
+    check("read/write of no registers", (empty_rw[0] == 0x97) && (empty_rw[1] == 0x03));
+
+    // a deferred read goes past the tables in front declining it, in the chain order
+    auto monitor = std::make_shared<MonitorRegisterTable>();
+    auto slow = std::make_shared<AsyncRegisterTable>();
+    komob::RegisterChain chain;
+    chain.add(monitor);
+    chain.add(slow, {{100, 16}});
+    chain.add(memory);
+    CompletionTarget target;
+    unsigned values[4];
+    bool taken;
+    chain.read_async(100, 4, values, false, komob::Completion(&target), taken);
+    check("deferred read behind a monitor", taken && (monitor->reads == 1));
+    if (taken) {
+        slow->pending.done();
+    }
+    check("deferred read completed", target.completed && target.success && (values[3] == 0xa5));
+    bool found = chain.read_async(4, 4, values, false, komob::Completion(&target), taken);
+    check("read outside the deferred range served synchronously", found && ! taken && (values[0] == memory->registers[4]));
+
+    return (failures == 0) ? 0 : -1;
+}
@@ -1,6 +1,6 @@
 // komob.hpp: Minimal Modbus Server
 // Created by Sanshiro Enomoto on 31 January 2026.
-// Version: 260213 //
+// Version: 261014 //
 
 
 #pragma once
@@ -9,28 +9,106 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#if defined(__linux__)
+#define KOMOB_HAS_EPOLL 1
+#include <sys/epoll.h>
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define KOMOB_HAS_KQUEUE 1
+#include <sys/event.h>
+#endif
+
+// io_uring engine (Linux 6.0 or later): enabled only with -DKOMOB_USE_IO_URING
+#ifdef KOMOB_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <csignal>
+#endif
+
+// Byte-swap kernels for the register payloads, selected by the compiler target (-mssse3, -mavx2, ...);
+// -DKOMOB_NO_SIMD for the portable code only
+#if ! defined(KOMOB_NO_SIMD) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#if defined(__SSE2__)
+#define KOMOB_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#define KOMOB_HAS_SSSE3 1
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define KOMOB_HAS_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#define KOMOB_HAS_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
 
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <memory>
+#include <new>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <type_traits>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 #include <cerrno>
 
 
-#if 0
-#define KOMOB_DEBUG(x) x
-#else
-#define KOMOB_DEBUG(x)
-#endif
+namespace komob {
 
 
-namespace komob {
+// Handle to finish a read taken by RegisterTable::read_block_async(): done() or fail(), once, from any thread
+class Completion {
+  public:
+    class Target {
+      public:
+        virtual void complete(bool success) = 0;
+      protected:
+        ~Target() {}
+    };
+    explicit Completion(Target* target=nullptr): target(target) {}
+    void done() const { target->complete(true); }
+    void fail() const { target->complete(false); }  // answered with "Slave Device Failure"
+  private:
+    Target* target;
+};
+
+
+// Thrown by a register table to refuse an access outright: the tables behind it are not asked,
+// and the request fails with "Illegal Data Address" (a write batch is aborted)
+class IllegalAddress: public std::runtime_error {
+  public:
+    IllegalAddress(): std::runtime_error("illegal data address") {}
+};
 
 
 class RegisterTable {
@@ -38,535 +116,4621 @@ class RegisterTable {
     virtual ~RegisterTable() {}
     virtual bool read(unsigned /*address*/, unsigned& /*value*/) { return false; }
     virtual bool write(unsigned /*address*/, unsigned /*value*/) { return false; }
+    
+    // Block access: returns the number of consecutive registers handled from "start" (0 if none).
+    // The defaults go through read()/write() and stop at the first address not handled;
+    // override them to serve a whole range with one call (memcpy, DMA, ...).
+    virtual unsigned read_block(unsigned start, unsigned count, unsigned* values) {
+        unsigned n = 0;
+        while ((n < count) && read(start + n, values[n])) {
+            n++;
+        }
+        return n;
+    }
+    virtual unsigned write_block(unsigned start, unsigned count, const unsigned* values) {
+        unsigned n = 0;
+        while ((n < count) && write(start + n, values[n])) {
+            n++;
+        }
+        return n;
+    }
+    
+    // Write batch: every write request (registers or coils) offering a part to this table is bracketed by
+    // begin_batch() and either commit(), when all the addresses of the request have been handled, or abort().
+    // A table can collect the writes and apply them at once in commit() (one bus burst, all or nothing);
+    // commit() may throw to report a device failure. The defaults do nothing: the writes are applied as they come.
+    virtual void begin_batch() {}
+    virtual void commit() {}
+    virtual void abort() {}
+    
+    // Deferred read: a table starting a slow operation (ADC conversion, DMA readback, ...) can take a whole read here
+    // and return true instead of blocking; it fills "values" later and calls completion.done() from any thread.
+    // The client waits for that response, and the other clients are served meanwhile.
+    // Offered to the tables in the chain order for "start", before their synchronous read, up to the first table
+    // taking or serving it, by the event loops (not with the register thread or the io_uring engine);
+    // the defaults decline, and the read goes to read_block() / read_input_block().
+    virtual bool read_block_async(unsigned /*start*/, unsigned /*count*/, unsigned* /*values*/, Completion /*completion*/) { return false; }
+    virtual bool read_input_block_async(unsigned /*start*/, unsigned /*count*/, unsigned* /*values*/, Completion /*completion*/) { return false; }
+    
+    // Input registers (FC 0x04, read-only), coils (FC 0x01/0x05/0x0F) and discrete inputs (FC 0x02, read-only)
+    // have their own address spaces; none of them is handled by default.
+    // Bits are passed one per byte (0 or 1); the server packs them on the wire.
+    virtual bool read_input(unsigned /*address*/, unsigned& /*value*/) { return false; }
+    virtual bool read_coil(unsigned /*address*/, bool& /*value*/) { return false; }
+    virtual bool write_coil(unsigned /*address*/, bool /*value*/) { return false; }
+    virtual bool read_discrete_input(unsigned /*address*/, bool& /*value*/) { return false; }
+    virtual unsigned read_input_block(unsigned start, unsigned count, unsigned* values) {
+        unsigned n = 0;
+        while ((n < count) && read_input(start + n, values[n])) {
+            n++;
+        }
+        return n;
+    }
+    virtual unsigned read_coils(unsigned start, unsigned count, uint8_t* bits) {
+        unsigned n = 0;
+        bool value;
+        while ((n < count) && read_coil(start + n, value)) {
+            bits[n++] = value ? 1 : 0;
+        }
+        return n;
+    }
+    virtual unsigned write_coils(unsigned start, unsigned count, const uint8_t* bits) {
+        unsigned n = 0;
+        while ((n < count) && write_coil(start + n, bits[n] != 0)) {
+            n++;
+        }
+        return n;
+    }
+    virtual unsigned read_discrete_inputs(unsigned start, unsigned count, uint8_t* bits) {
+        unsigned n = 0;
+        bool value;
+        while ((n < count) && read_discrete_input(start + n, value)) {
+            bits[n++] = value ? 1 : 0;
+        }
+        return n;
+    }
 };
 
 
-enum class DataWidth { W16, W32 };
-        
-    
-class Server {
+// Registers in a memory-mapped window of a UIO device ("/dev/uio0") or of "/dev/mem":
+// Modbus address "address_offset + i" is the 32-bit word at "base + i * stride" (bytes) of the device.
+// For UIO, "base" selects the map: N * page size for map N.
+class MmapRegisterTable: public RegisterTable {
   public:
-    Server(
-        std::shared_ptr<RegisterTable> register_table=nullptr,
-        DataWidth width=DataWidth::W32,
-        int keepalive_idle_sec=3600,
-        int packet_timeout_msec = 1000
-    );
-    inline Server& add(std::shared_ptr<RegisterTable> register_table);
-    inline int run(int argc, char** argv);
-    inline void serve(unsigned port=502);
+    inline MmapRegisterTable(const std::string& device, uint64_t base, unsigned count, unsigned address_offset=0, unsigned stride=4);
+    inline ~MmapRegisterTable() override;
+    MmapRegisterTable(const MmapRegisterTable&) = delete;
+    MmapRegisterTable& operator=(const MmapRegisterTable&) = delete;
+    bool read(unsigned address, unsigned& value) override {
+        return read_block(address, 1, &value) == 1;
+    }
+    bool write(unsigned address, unsigned value) override {
+        return write_block(address, 1, &value) == 1;
+    }
+    unsigned read_block(unsigned start, unsigned count, unsigned* values) override {
+        unsigned n = available(start, count);
+        const volatile uint32_t* word = registers + static_cast<size_t>(start - address_offset) * step;
+        for (unsigned i = 0; i < n; i++, word += step) {
+            values[i] = *word;
+        }
+        return n;
+    }
+    unsigned write_block(unsigned start, unsigned count, const unsigned* values) override {
+        unsigned n = available(start, count);
+        volatile uint32_t* word = registers + static_cast<size_t>(start - address_offset) * step;
+        for (unsigned i = 0; i < n; i++, word += step) {
+            *word = static_cast<uint32_t>(values[i]);
+        }
+        return n;
+    }
   private:
-    inline void set_nonblocking(int fd);
-    inline void set_sock_timeouts_ms(int fd, int rcv_ms, int snd_ms);
-    inline void set_keepalive(int fd, int idle, int interval, int count);
-    inline bool handle_single_request(int fd);
-    inline std::vector<uint8_t> dispatch_pdu(const std::vector<uint8_t>& request);
-    inline std::vector<uint8_t> exception_pdu(uint8_t function_code, uint8_t exception_code);
-    inline std::vector<uint8_t> read_holding_registers(const std::vector<uint8_t>& request);
-    inline std::vector<uint8_t> write_single_register(const std::vector<uint8_t>& request);
-    inline std::vector<uint8_t> write_multiple_registers(const std::vector<uint8_t>& request);
+    // number of registers from "start" inside the window
+    unsigned available(unsigned start, unsigned count) const {
+        if ((start < address_offset) || (start - address_offset >= size)) {
+            return 0;
+        }
+        return std::min(count, size - (start - address_offset));
+    }
   private:
-    DataWidth data_width;
-    int keepalive_idle, keepalive_interval, keepalive_count;
-    int timeout_ms;
-    std::vector<std::shared_ptr<RegisterTable>> register_tables;
+    void* mapped = MAP_FAILED;
+    size_t mapped_size = 0;
+    volatile uint32_t* registers;
+    unsigned size, address_offset;
+    size_t step;  // stride in words
+};
 
-  private:
-    static constexpr uint8_t EX_ILLEGAL_FUNCTION = 0x01;
-    static constexpr uint8_t EX_ILLEGAL_ADDRESS  = 0x02;
-    static constexpr uint8_t EX_ILLEGAL_VALUE    = 0x03;
-    static constexpr uint8_t EX_SLAVE_FAILURE    = 0x04;
-    static constexpr uint8_t FC_READ_HOLDING_REGISTERS   = 0x03;
-    static constexpr uint8_t FC_WRITE_SINGLE_REGISTER    = 0x06;
-    static constexpr uint8_t FC_WRITE_MULTIPLE_REGISTERS = 0x10;
+
+inline MmapRegisterTable::MmapRegisterTable(const std::string& device, uint64_t base, unsigned count, unsigned offset, unsigned stride)
+    : size(count), address_offset(offset), step(stride / 4)
+{
+    if ((stride == 0) || (stride % 4 != 0) || (base % 4 != 0)) {
+        throw std::invalid_argument("MmapRegisterTable: base and stride must be multiples of 4");
+    }
+    if (count == 0) {
+        throw std::invalid_argument("MmapRegisterTable: no registers");
+    }
     
-    inline uint16_t get_u16(const uint8_t* p) {
-        return static_cast<uint16_t>((p[0] << 8) | p[1]);
+    // mmap() needs a page-aligned offset; the window may start in the middle of a page
+    uint64_t page_size = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+    uint64_t page_base = base - (base % page_size);
+    mapped_size = static_cast<size_t>((base - page_base) + static_cast<uint64_t>(count - 1) * stride + 4);
+    
+    int fd = ::open(device.c_str(), O_RDWR | O_SYNC);
+    if (fd < 0) {
+        throw std::runtime_error("MmapRegisterTable: unable to open " + device + ": " + std::strerror(errno));
     }
-    inline uint32_t get_u32(const uint8_t* p) {
-        return static_cast<uint32_t>((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
-    }
-    inline void push_u16(std::vector<uint8_t>& out, uint16_t v) {
-        out.push_back(static_cast<uint8_t>((v >> 8) & 0xff));
-        out.push_back(static_cast<uint8_t>(v & 0xff));
-    }
-    inline void push_u32(std::vector<uint8_t>& out, uint32_t v) {
-        out.push_back(static_cast<uint8_t>((v >> 24) & 0xff));
-        out.push_back(static_cast<uint8_t>((v >> 16) & 0xff));
-        out.push_back(static_cast<uint8_t>((v >> 8) & 0xff));
-        out.push_back(static_cast<uint8_t>(v & 0xff));
-    }
-    inline bool read_exact(int fd, uint8_t* buf, size_t n) {
-        size_t off = 0;
-        while (off < n) {
-            ssize_t recv_size = ::recv(fd, buf + off, n - off, 0);
-            if (recv_size == 0) {
-                return false;          // connection closed
-            }
-            if (recv_size < 0) {
-                if (errno == EINTR) {
-                    continue;
-                }
-                else {
-                    return false;
-                }
+    mapped = ::mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(page_base));
+    int mmap_errno = errno;
+    ::close(fd);  // the mapping stays
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("MmapRegisterTable: unable to map " + device + ": " + std::strerror(mmap_errno));
+    }
+    registers = reinterpret_cast<volatile uint32_t*>(static_cast<uint8_t*>(mapped) + (base - page_base));
+}
+
+
+inline MmapRegisterTable::~MmapRegisterTable()
+{
+    if (mapped != MAP_FAILED) {
+        ::munmap(mapped, mapped_size);
+    }
+}
+
+
+// Addresses [start, start+count) owned by a register table
+struct AddressRange {
+    unsigned start, count;
+};
+
+
+// Read-through cache in front of a slow table: the registers of each added range are read
+// from the backing table as one block and served from that snapshot until its TTL expires.
+// Writes go through to the backing table and invalidate the snapshots they touch.
+// Addresses outside the ranges are passed through.
+class CachedRegisterTable: public RegisterTable {
+  public:
+    explicit CachedRegisterTable(std::shared_ptr<RegisterTable> backing): backing(std::move(backing)) {}
+    inline CachedRegisterTable& add_range(AddressRange range, std::chrono::milliseconds ttl);
+    inline void invalidate();
+    uint64_t hits() const { return hit_count.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return miss_count.load(std::memory_order_relaxed); }
+    void reset_counters() { hit_count = 0; miss_count = 0; }
+    bool read(unsigned address, unsigned& value) override {
+        return read_block(address, 1, &value) == 1;
+    }
+    bool write(unsigned address, unsigned value) override {
+        return write_block(address, 1, &value) == 1;
+    }
+    inline unsigned read_block(unsigned start, unsigned count, unsigned* values) override;
+    inline unsigned write_block(unsigned start, unsigned count, const unsigned* values) override;
+    // the other data types are not cached
+    unsigned read_input_block(unsigned start, unsigned count, unsigned* values) override {
+        return backing->read_input_block(start, count, values);
+    }
+    unsigned read_coils(unsigned start, unsigned count, uint8_t* bits) override {
+        return backing->read_coils(start, count, bits);
+    }
+    unsigned write_coils(unsigned start, unsigned count, const uint8_t* bits) override {
+        return backing->write_coils(start, count, bits);
+    }
+    unsigned read_discrete_inputs(unsigned start, unsigned count, uint8_t* bits) override {
+        return backing->read_discrete_inputs(start, count, bits);
+    }
+    void begin_batch() override { backing->begin_batch(); }
+    void commit() override { backing->commit(); }
+    void abort() override { backing->abort(); }
+  private:
+    using Clock = std::chrono::steady_clock;
+    struct Snapshot {
+        AddressRange range;
+        Clock::duration ttl;
+        Clock::time_point expiry;
+        bool valid = false;
+        unsigned filled = 0;  // registers the backing table handled from "range.start"
+        std::vector<unsigned> values;
+    };
+    std::shared_ptr<RegisterTable> backing;
+    std::vector<Snapshot> snapshots;  // sorted by start, not overlapping
+    std::atomic<uint64_t> hit_count{0}, miss_count{0};
+};
+
+
+inline CachedRegisterTable& CachedRegisterTable::add_range(AddressRange range, std::chrono::milliseconds ttl)
+{
+    if (range.count == 0) {
+        return *this;
+    }
+    for (const auto& snapshot: snapshots) {
+        uint64_t end = static_cast<uint64_t>(snapshot.range.start) + snapshot.range.count;
+        if ((range.start < end) && (snapshot.range.start < static_cast<uint64_t>(range.start) + range.count)) {
+            throw std::invalid_argument("CachedRegisterTable: overlapping ranges");
+        }
+    }
+    Snapshot snapshot;
+    snapshot.range = range;
+    snapshot.ttl = ttl;
+    snapshot.values.resize(range.count);
+    auto position = std::upper_bound(
+        snapshots.begin(), snapshots.end(), range.start,
+        [](unsigned address, const Snapshot& other) { return address < other.range.start; }
+    );
+    snapshots.insert(position, std::move(snapshot));
+    return *this;
+}
+
+
+inline void CachedRegisterTable::invalidate()
+{
+    for (auto& snapshot: snapshots) {
+        snapshot.valid = false;
+    }
+}
+
+
+inline unsigned CachedRegisterTable::read_block(unsigned start, unsigned count, unsigned* values)
+{
+    unsigned done = 0;
+    while (done < count) {
+        unsigned address = start + done;
+        auto next = std::upper_bound(
+            snapshots.begin(), snapshots.end(), address,
+            [](unsigned address, const Snapshot& snapshot) { return address < snapshot.range.start; }
+        );
+        Snapshot* snapshot = nullptr;
+        if (next != snapshots.begin()) {
+            Snapshot& candidate = *(next - 1);
+            if (address - candidate.range.start < candidate.range.count) {
+                snapshot = &candidate;
             }
-            off += static_cast<size_t>(recv_size);
         }
         
-        return true;
-    }
-    inline bool write_exact(int fd, const uint8_t* buf, size_t n) {
-        size_t off = 0;
-        while (off < n) {
-            ssize_t sent_size = ::send(fd, buf + off, n - off, 0);
-            if (sent_size <= 0) {
-                if (sent_size < 0 && errno == EINTR) {
-                    continue;
-                }
-                else {
-                    return false;
-                }
+        if (! snapshot) {
+            // not cached: up to the next range
+            unsigned length = count - done;
+            if ((next != snapshots.end()) && (next->range.start - address < length)) {
+                length = next->range.start - address;
             }
-            off += static_cast<size_t>(sent_size);
+            unsigned handled = backing->read_block(address, length, values + done);
+            done += handled;
+            if (handled < length) {
+                break;
+            }
+            continue;
         }
         
-        return true;
+        auto now = Clock::now();
+        if (snapshot->valid && (now < snapshot->expiry)) {
+            hit_count.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            miss_count.fetch_add(1, std::memory_order_relaxed);
+            snapshot->filled = backing->read_block(snapshot->range.start, snapshot->range.count, snapshot->values.data());
+            snapshot->valid = true;
+            snapshot->expiry = now + snapshot->ttl;
+        }
+        unsigned offset = address - snapshot->range.start;
+        if (offset >= snapshot->filled) {
+            break;
+        }
+        unsigned length = std::min(count - done, snapshot->filled - offset);
+        std::copy_n(snapshot->values.begin() + offset, length, values + done);
+        done += length;
+        if ((done < count) && (snapshot->filled < snapshot->range.count)) {
+            break;  // the backing table did not handle the rest of the range
+        }
+    }
+    
+    return done;
+}
+
+
+inline unsigned CachedRegisterTable::write_block(unsigned start, unsigned count, const unsigned* values)
+{
+    unsigned handled = backing->write_block(start, count, values);
+    uint64_t end = static_cast<uint64_t>(start) + handled;
+    for (auto& snapshot: snapshots) {
+        if ((snapshot.range.start < end) && (start < static_cast<uint64_t>(snapshot.range.start) + snapshot.range.count)) {
+            snapshot.valid = false;
+        }
+    }
+    return handled;
+}
+
+
+// Register image refreshed from a slow table at a fixed period, by its own thread, into a
+// seqlock-protected buffer; reads are one copy from the image and never wait for the device.
+// Writes go to the backing table and are seen in the image after the next refresh.
+// With a period of zero no thread runs, and refresh() is to be called by the user.
+class SnapshotRegisterTable: public RegisterTable {
+  public:
+    inline SnapshotRegisterTable(std::shared_ptr<RegisterTable> backing, AddressRange range, std::chrono::milliseconds period);
+    inline ~SnapshotRegisterTable() override;
+    SnapshotRegisterTable(const SnapshotRegisterTable&) = delete;
+    SnapshotRegisterTable& operator=(const SnapshotRegisterTable&) = delete;
+    inline void refresh();
+    uint64_t refresh_count() const { return sequence.load(std::memory_order_relaxed) / 2; }
+    bool read(unsigned address, unsigned& value) override {
+        return read_block(address, 1, &value) == 1;
+    }
+    bool write(unsigned address, unsigned value) override {
+        return write_block(address, 1, &value) == 1;
+    }
+    inline unsigned read_block(unsigned start, unsigned count, unsigned* values) override;
+    inline unsigned write_block(unsigned start, unsigned count, const unsigned* values) override;
+    // the other data types go to the backing table directly
+    unsigned read_input_block(unsigned start, unsigned count, unsigned* values) override {
+        std::lock_guard<std::mutex> lock(backing_mutex);
+        return backing->read_input_block(start, count, values);
+    }
+    unsigned read_coils(unsigned start, unsigned count, uint8_t* bits) override {
+        std::lock_guard<std::mutex> lock(backing_mutex);
+        return backing->read_coils(start, count, bits);
+    }
+    unsigned write_coils(unsigned start, unsigned count, const uint8_t* bits) override {
+        std::lock_guard<std::mutex> lock(backing_mutex);
+        return backing->write_coils(start, count, bits);
     }
+    unsigned read_discrete_inputs(unsigned start, unsigned count, uint8_t* bits) override {
+        std::lock_guard<std::mutex> lock(backing_mutex);
+        return backing->read_discrete_inputs(start, count, bits);
+    }
+    void begin_batch() override {
+        std::lock_guard<std::mutex> lock(backing_mutex);
+        backing->begin_batch();
+    }
+    void commit() override {
+        std::lock_guard<std::mutex> lock(backing_mutex);
+        backing->commit();
+    }
+    void abort() override {
+        std::lock_guard<std::mutex> lock(backing_mutex);
+        backing->abort();
+    }
+  private:
+    std::shared_ptr<RegisterTable> backing;
+    AddressRange range;
+    std::mutex backing_mutex;  // the refresh and the writes reach the backing table from different threads
+    std::vector<unsigned> scratch;
+    std::unique_ptr<std::atomic<unsigned>[]> image;
+    std::atomic<unsigned> filled{0};  // registers the backing table handled in the last refresh
+    std::atomic<uint64_t> sequence{0};  // odd while the image is being updated
+    std::thread producer;
+    std::mutex stop_mutex;
+    std::condition_variable stop_condition;
+    bool stopping = false;
 };
 
 
+inline SnapshotRegisterTable::SnapshotRegisterTable(std::shared_ptr<RegisterTable> backing_table, AddressRange image_range, std::chrono::milliseconds period)
+    : backing(std::move(backing_table)), range(image_range), scratch(image_range.count), image(new std::atomic<unsigned>[image_range.count])
+{
+    for (unsigned i = 0; i < range.count; i++) {
+        image[i].store(0, std::memory_order_relaxed);
+    }
+    refresh();  // valid from the start
+    
+    if (period.count() > 0) {
+        producer = std::thread([this, period]() {
+            std::unique_lock<std::mutex> lock(stop_mutex);
+            auto next = std::chrono::steady_clock::now() + period;
+            while (! stop_condition.wait_until(lock, next, [this]() { return stopping; })) {
+                lock.unlock();
+                refresh();
+                lock.lock();
+                next += period;
+            }
+        });
+    }
+}
+
 
-inline Server::Server(std::shared_ptr<RegisterTable> register_table, DataWidth width, int keepalive_idle_sec, int packet_timeout_ms)
+inline SnapshotRegisterTable::~SnapshotRegisterTable()
 {
-    if (register_table) {
-        register_tables.push_back(register_table);
+    if (producer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(stop_mutex);
+            stopping = true;
+        }
+        stop_condition.notify_all();
+        producer.join();
     }
+}
 
-    data_width = width;
-    
-    keepalive_idle = keepalive_idle_sec;
-    keepalive_interval = 30;
-    keepalive_count = 3;
+
+inline void SnapshotRegisterTable::refresh()
+{
+    std::lock_guard<std::mutex> lock(backing_mutex);
+    unsigned handled = backing->read_block(range.start, range.count, scratch.data());
     
-    timeout_ms = packet_timeout_ms;
+    // single writer (under backing_mutex): readers retry if the sequence changed while they copied
+    uint64_t current = sequence.load(std::memory_order_relaxed);
+    sequence.store(current + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned i = 0; i < handled; i++) {
+        image[i].store(scratch[i], std::memory_order_relaxed);
+    }
+    filled.store(handled, std::memory_order_relaxed);
+    sequence.store(current + 2, std::memory_order_release);
 }
-    
-    
-inline Server& Server::add(std::shared_ptr<RegisterTable> register_table)
+
+
+inline unsigned SnapshotRegisterTable::read_block(unsigned start, unsigned count, unsigned* values)
 {
-    if (register_table) {
-        register_tables.push_back(register_table);
+    if ((start < range.start) || (start - range.start >= range.count)) {
+        return 0;
+    }
+    unsigned offset = start - range.start;
+    while (true) {
+        uint64_t before = sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        unsigned available = filled.load(std::memory_order_relaxed);
+        unsigned n = (offset < available) ? std::min(count, available - offset) : 0;
+        for (unsigned i = 0; i < n; i++) {
+            values[i] = image[offset + i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) == before) {
+            return n;
+        }
     }
-    return *this;
 }
-    
 
-inline int Server::run(int argc, char** argv)
+
+inline unsigned SnapshotRegisterTable::write_block(unsigned start, unsigned count, const unsigned* values)
 {
-    unsigned port = 502;
-    if (argc >= 2) {
-        port = std::stoi(argv[1]);
+    if ((start < range.start) || (start - range.start >= range.count)) {
+        return 0;
+    }
+    count = std::min(count, range.count - (start - range.start));
+    std::lock_guard<std::mutex> lock(backing_mutex);
+    return backing->write_block(start, count, values);
+}
+
+
+// Compile-time register map over the members of a user struct; the address decoding is
+// resolved by the compiler, and a block on an array member is a plain copy loop:
+//   StaticRegisterTable<Device,
+//       Register<0x00, &Device::status, false>,    // one register, read-only
+//       RegisterArray<0x10, &Device::samples>,     // consecutive registers on an array
+//       Accessor<0x20, &Device::mode, &Device::set_mode>  // getter and (optional) setter
+//   >
+template<typename MemberPointer> struct MemberPointerType;
+template<typename Class, typename T> struct MemberPointerType<T Class::*> { using type = T; };
+
+
+template<unsigned Address, auto Member, bool Writable = true>
+struct Register {
+    using Type = typename MemberPointerType<decltype(Member)>::type;
+    static_assert(std::is_integral<Type>::value || std::is_enum<Type>::value, "Register needs an integral member");
+    static constexpr unsigned start = Address, size = 1;
+    template<typename Object> static unsigned read(Object& object, unsigned address, unsigned, unsigned* values) {
+        if (address != Address) {
+            return 0;
+        }
+        values[0] = static_cast<unsigned>(object.*Member);
+        return 1;
+    }
+    template<typename Object> static unsigned write(Object& object, unsigned address, unsigned, const unsigned* values) {
+        if constexpr (Writable) {
+            if (address == Address) {
+                object.*Member = static_cast<Type>(values[0]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+};
+
+
+template<unsigned Address, auto Member, bool Writable = true>
+struct RegisterArray {
+    using Array = typename MemberPointerType<decltype(Member)>::type;
+    using Type = std::remove_extent_t<Array>;
+    static_assert(std::rank<Array>::value == 1, "RegisterArray needs an array member");
+    static_assert(std::is_integral<Type>::value || std::is_enum<Type>::value, "RegisterArray needs an integral array");
+    static constexpr unsigned start = Address, size = std::extent<Array>::value;
+    template<typename Object> static unsigned read(Object& object, unsigned address, unsigned count, unsigned* values) {
+        if ((address < Address) || (address - Address >= size)) {
+            return 0;
+        }
+        const Type* source = (object.*Member) + (address - Address);
+        unsigned n = std::min(count, size - (address - Address));
+        for (unsigned i = 0; i < n; i++) {
+            values[i] = static_cast<unsigned>(source[i]);
+        }
+        return n;
+    }
+    template<typename Object> static unsigned write(Object& object, unsigned address, unsigned count, const unsigned* values) {
+        if constexpr (Writable) {
+            if ((address >= Address) && (address - Address < size)) {
+                Type* destination = (object.*Member) + (address - Address);
+                unsigned n = std::min(count, size - (address - Address));
+                for (unsigned i = 0; i < n; i++) {
+                    destination[i] = static_cast<Type>(values[i]);
+                }
+                return n;
+            }
+        }
+        return 0;
+    }
+};
+
+
+template<unsigned Address, auto Getter, auto Setter = nullptr>
+struct Accessor {
+    static constexpr unsigned start = Address, size = 1;
+    template<typename Object> static unsigned read(Object& object, unsigned address, unsigned, unsigned* values) {
+        if (address != Address) {
+            return 0;
+        }
+        values[0] = static_cast<unsigned>((object.*Getter)());
+        return 1;
+    }
+    template<typename Object> static unsigned write(Object& object, unsigned address, unsigned, const unsigned* values) {
+        if constexpr (! std::is_same<decltype(Setter), std::nullptr_t>::value) {
+            if (address == Address) {
+                (object.*Setter)(values[0]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+};
+
+
+// The object is referred to, not copied; it must outlive the table
+template<typename Object, typename... Fields>
+class StaticRegisterTable: public RegisterTable {
+    static_assert(sizeof...(Fields) > 0, "no registers");
+  public:
+    explicit StaticRegisterTable(Object& object): object(object) {}
+    // for Server::add(table, table->ranges()), to be reached directly from the chain
+    static std::vector<AddressRange> ranges() {
+        return { AddressRange{Fields::start, Fields::size}... };
+    }
+    bool read(unsigned address, unsigned& value) override {
+        return read_block(address, 1, &value) == 1;
+    }
+    bool write(unsigned address, unsigned value) override {
+        return write_block(address, 1, &value) == 1;
+    }
+    unsigned read_block(unsigned start, unsigned count, unsigned* values) override {
+        unsigned done = 0;
+        while (done < count) {
+            unsigned n = 0;
+            ((n = Fields::read(object, start + done, count - done, values + done)) || ...);
+            if (n == 0) {
+                break;
+            }
+            done += n;
+        }
+        return done;
+    }
+    unsigned write_block(unsigned start, unsigned count, const unsigned* values) override {
+        unsigned done = 0;
+        while (done < count) {
+            unsigned n = 0;
+            ((n = Fields::write(object, start + done, count - done, values + done)) || ...);
+            if (n == 0) {
+                break;
+            }
+            done += n;
+        }
+        return done;
+    }
+  private:
+    static constexpr bool disjoint() {
+        constexpr uint64_t starts[] = { Fields::start... };
+        constexpr uint64_t sizes[] = { Fields::size... };
+        for (size_t i = 0; i < sizeof...(Fields); i++) {
+            for (size_t j = i + 1; j < sizeof...(Fields); j++) {
+                if ((starts[i] < starts[j] + sizes[j]) && (starts[j] < starts[i] + sizes[i])) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    static_assert(disjoint(), "overlapping registers");
+  private:
+    Object& object;
+};
+
+
+// Chain-of-Responsibility of register tables, with the tables that declare their address ranges
+// reached directly through a sorted interval index
+class RegisterChain {
+  public:
+    inline void add(std::shared_ptr<RegisterTable> register_table, std::vector<AddressRange> ranges = {}, bool front = false);
+    inline bool read(unsigned start, unsigned count, unsigned* values);
+    inline bool write(unsigned start, unsigned count, const unsigned* values);
+    inline bool read_inputs(unsigned start, unsigned count, unsigned* values);
+    inline bool read_coils(unsigned start, unsigned count, uint8_t* bits);
+    inline bool write_coils(unsigned start, unsigned count, const uint8_t* bits);
+    inline bool read_discrete_inputs(unsigned start, unsigned count, uint8_t* bits);
+    inline bool read_async(unsigned start, unsigned count, unsigned* values, bool input, Completion completion, bool& taken);
+    void set_table_locking(bool enabled) { lock_tables = enabled; }
+    bool empty() const { return entries.empty(); }
+    inline std::vector<uint64_t> access_counts() const;
+  private:
+    struct Entry {
+        std::shared_ptr<RegisterTable> table;
+        std::vector<AddressRange> ranges;  // empty: every address
+        std::shared_ptr<std::mutex> mutex;  // shared by the entries of the same table
+        std::shared_ptr<std::atomic<uint64_t>> accesses;  // block calls, from any thread
+    };
+    struct Link {
+        RegisterTable* table;
+        std::mutex* mutex;
+        std::atomic<uint64_t>* accesses;
+        bool declared;  // registered with ranges: it declines a block as a whole
+        bool operator==(const Link& other) const { return table == other.table; }
+    };
+    struct Route {
+        unsigned start;  // up to the start of the next route
+        std::vector<Link> tables;  // in the chain order
+    };
+    inline void build_routes();
+    inline const Route& find_route(unsigned address, uint64_t& end) const;
+    template<typename BlockAccess> inline bool access(unsigned start, unsigned count, BlockAccess block_access);
+    template<typename BlockAccess> inline bool write_batch(unsigned start, unsigned count, BlockAccess block_access);
+    inline void end_batch(const Link* batch, unsigned size, bool commit);
+    static constexpr unsigned MAX_BATCH_TABLES = 64;
+  private:
+    std::vector<Entry> entries;
+    std::vector<Route> routes{Route{0, {}}};
+    bool lock_tables = false;
+};
+
+
+enum class DataWidth { W16, W32 };
+
+
+// Register values <-> Modbus wire: "count" values, big endian, of 2 bytes (W16, the lower 16 bits) or 4 bytes (W32)
+inline void encode_registers(uint8_t* out, const unsigned* values, unsigned count, DataWidth width);
+inline void decode_registers(unsigned* values, const uint8_t* in, unsigned count, DataWidth width);
+
+
+#if defined(KOMOB_HAS_SSE2)
+namespace simd {
+    static_assert(sizeof(unsigned) == 4, "SIMD kernels assume 32-bit unsigned");
+    // byte swap in each 32-bit lane
+    inline __m128i swap32(__m128i x) {
+#if defined(KOMOB_HAS_SSSE3)
+        return _mm_shuffle_epi8(x, _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+#else
+        x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+#endif
+    }
+    // lower 16 bits of 4 + 4 values -> 8 big-endian 16-bit words
+    inline __m128i pack16(__m128i a, __m128i b) {
+#if defined(KOMOB_HAS_SSSE3)
+        const __m128i low = _mm_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i high = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 1, 0, 5, 4, 9, 8, 13, 12);
+        return _mm_or_si128(_mm_shuffle_epi8(a, low), _mm_shuffle_epi8(b, high));
+#else
+        // sign-extended, so that the saturating pack keeps the lower 16 bits as they are
+        a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+        b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+        __m128i x = _mm_packs_epi32(a, b);
+        return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+#endif
+    }
+    // 8 big-endian 16-bit words -> 4 + 4 values
+    inline void unpack16(__m128i x, __m128i& a, __m128i& b) {
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        a = _mm_unpacklo_epi16(x, _mm_setzero_si128());
+        b = _mm_unpackhi_epi16(x, _mm_setzero_si128());
+    }
+}
+#endif
+
+
+inline void encode_registers(uint8_t* out, const unsigned* values, unsigned count, DataWidth width)
+{
+    unsigned i = 0;
+    if (width == DataWidth::W32) {
+#if defined(KOMOB_HAS_AVX2)
+        const __m256i mask = _mm256_setr_epi8(
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+        );
+        for (; i + 8 <= count; i += 8) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 4 * i), _mm256_shuffle_epi8(x, mask));
+        }
+#endif
+#if defined(KOMOB_HAS_SSE2)
+        for (; i + 4 <= count; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * i), simd::swap32(x));
+        }
+#elif defined(KOMOB_HAS_NEON)
+        for (; i + 4 <= count; i += 4) {
+            uint8x16_t x = vreinterpretq_u8_u32(vld1q_u32(values + i));
+            vst1q_u8(out + 4 * i, vrev32q_u8(x));
+        }
+#endif
+        for (; i < count; i++) {
+            uint32_t v = values[i];
+            out[4 * i + 0] = static_cast<uint8_t>(v >> 24);
+            out[4 * i + 1] = static_cast<uint8_t>(v >> 16);
+            out[4 * i + 2] = static_cast<uint8_t>(v >> 8);
+            out[4 * i + 3] = static_cast<uint8_t>(v);
+        }
+    }
+    else {
+#if defined(KOMOB_HAS_SSE2)
+        for (; i + 8 <= count; i += 8) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i + 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i), simd::pack16(a, b));
+        }
+#elif defined(KOMOB_HAS_NEON)
+        for (; i + 8 <= count; i += 8) {
+            uint16x8_t x = vcombine_u16(vmovn_u32(vld1q_u32(values + i)), vmovn_u32(vld1q_u32(values + i + 4)));
+            vst1q_u8(out + 2 * i, vrev16q_u8(vreinterpretq_u8_u16(x)));
+        }
+#endif
+        for (; i < count; i++) {
+            out[2 * i + 0] = static_cast<uint8_t>(values[i] >> 8);
+            out[2 * i + 1] = static_cast<uint8_t>(values[i]);
+        }
+    }
+}
+
+
+inline void decode_registers(unsigned* values, const uint8_t* in, unsigned count, DataWidth width)
+{
+    unsigned i = 0;
+    if (width == DataWidth::W32) {
+#if defined(KOMOB_HAS_AVX2)
+        const __m256i mask = _mm256_setr_epi8(
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+        );
+        for (; i + 8 <= count; i += 8) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 4 * i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + i), _mm256_shuffle_epi8(x, mask));
+        }
+#endif
+#if defined(KOMOB_HAS_SSE2)
+        for (; i + 4 <= count; i += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4 * i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), simd::swap32(x));
+        }
+#elif defined(KOMOB_HAS_NEON)
+        for (; i + 4 <= count; i += 4) {
+            vst1q_u32(values + i, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(in + 4 * i))));
+        }
+#endif
+        for (; i < count; i++) {
+            const uint8_t* p = in + 4 * i;
+            values[i] = (unsigned(p[0]) << 24) | (unsigned(p[1]) << 16) | (unsigned(p[2]) << 8) | unsigned(p[3]);
+        }
+    }
+    else {
+#if defined(KOMOB_HAS_SSE2)
+        for (; i + 8 <= count; i += 8) {
+            __m128i a, b;
+            simd::unpack16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i)), a, b);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), a);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i + 4), b);
+        }
+#elif defined(KOMOB_HAS_NEON)
+        for (; i + 8 <= count; i += 8) {
+            uint16x8_t x = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(in + 2 * i)));
+            vst1q_u32(values + i, vmovl_u16(vget_low_u16(x)));
+            vst1q_u32(values + i + 4, vmovl_u16(vget_high_u16(x)));
+        }
+#endif
+        for (; i < count; i++) {
+            values[i] = (unsigned(in[2 * i]) << 8) | unsigned(in[2 * i + 1]);
+        }
+    }
+}
+
+
+// Register-table access with several event loops (Server::set_threads())
+enum class Concurrency {
+    Serialized,  // one request at a time across all the tables (as with a single thread)
+    PerTable,    // each table is called by one thread at a time
+    ThreadSafe   // no locking: the tables are declared to be thread-safe
+};
+
+
+enum class EventBackend { Auto, Poll, Epoll, Kqueue, IoUring };
+
+
+// What to do with a new connection when the limit is reached (Server::set_max_connections())
+enum class ConnectionPolicy { Reject, EvictOldestIdle };
+
+// Opt-in settings for deterministic latency (Server::set_realtime())
+struct RealtimeProfile {
+    bool lock_memory = true;    // mlockall(), after reserving the memory for "connections"; no heap trimming
+    unsigned connections = 64;  // the connection slots of each event loop, when set_max_connections() gives no limit
+    int priority = 0;           // SCHED_FIFO priority (1 to 99) of the event loops and the register thread; 0: not changed
+    std::vector<int> cpus;      // CPU of each event loop, then of the register thread; empty: not pinned
+    bool tcp_nodelay = true;
+    bool tcp_quickack = true;   // re-armed after each receive (one more system call per receive)
+    int busy_poll_us = 0;       // SO_BUSY_POLL on the client sockets (Linux); 0: not used
+};
+
+// What a rate limit applies to (Server::set_rate_limit()): each connection, or all the connections from one client address
+enum class RateLimitScope { Connection, Address };
+
+
+// Readiness notification used by the Server event loop
+class EventPoller {
+  public:
+    struct Event {
+        int fd;
+        bool readable, writable, error;
+    };
+  public:
+    virtual ~EventPoller() {}
+    virtual void add(int fd) = 0;  // for reading
+    virtual void remove(int fd) = 0;
+    virtual void modify(int fd, bool readable, bool writable) = 0;
+    // returns the number of events (-1 on error, with errno set)
+    virtual int wait(int timeout_ms, std::vector<Event>& events) = 0;
+    inline static std::unique_ptr<EventPoller> create(EventBackend backend);
+};
+
+
+// Portable fallback: every wait() scans all the registered descriptors
+class PollEventPoller: public EventPoller {
+  public:
+    void add(int fd) override {
+        index[fd] = pollfd_list.size();
+        pollfd_list.push_back(pollfd{fd, POLLIN, 0});
+    }
+    void remove(int fd) override {
+        auto found = index.find(fd);
+        if (found == index.end()) {
+            return;
+        }
+        size_t i = found->second;
+        index.erase(found);
+        if (i + 1 < pollfd_list.size()) {
+            pollfd_list[i] = pollfd_list.back();
+            index[pollfd_list[i].fd] = i;
+        }
+        pollfd_list.pop_back();
+    }
+    void modify(int fd, bool readable, bool writable) override {
+        auto found = index.find(fd);
+        if (found != index.end()) {
+            pollfd_list[found->second].events = static_cast<short>((readable ? POLLIN : 0) | (writable ? POLLOUT : 0));
+        }
+    }
+    int wait(int timeout_ms, std::vector<Event>& events) override {
+        events.clear();
+        int n = ::poll(pollfd_list.data(), static_cast<nfds_t>(pollfd_list.size()), timeout_ms);
+        if (n <= 0) {
+            return n;
+        }
+        for (auto& pfd: pollfd_list) {
+            if (pfd.revents) {
+                events.push_back(Event{pfd.fd, (pfd.revents & POLLIN) != 0, (pfd.revents & POLLOUT) != 0, (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0});
+            }
+        }
+        return static_cast<int>(events.size());
+    }
+  private:
+    std::vector<pollfd> pollfd_list;
+    std::unordered_map<int, size_t> index;  // fd -> position in pollfd_list
+};
+
+
+#ifdef KOMOB_HAS_EPOLL
+class EpollEventPoller: public EventPoller {
+  public:
+    EpollEventPoller(): ready(256) {
+        epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+            throw std::runtime_error("epoll_create1() failed");
+        }
+    }
+    ~EpollEventPoller() override {
+        ::close(epoll_fd);
+    }
+    void add(int fd) override {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            throw std::runtime_error("epoll_ctl() failed");
+        }
+    }
+    void remove(int fd) override {
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    void modify(int fd, bool readable, bool writable) override {
+        epoll_event ev{};
+        ev.events = 0;
+        if (readable) {
+            ev.events |= EPOLLIN;
+        }
+        if (writable) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.fd = fd;
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    int wait(int timeout_ms, std::vector<Event>& events) override {
+        events.clear();
+        int n = ::epoll_wait(epoll_fd, ready.data(), static_cast<int>(ready.size()), timeout_ms);
+        for (int i = 0; i < n; i++) {
+            unsigned flags = ready[i].events;
+            events.push_back(Event{ready[i].data.fd, (flags & EPOLLIN) != 0, (flags & EPOLLOUT) != 0, (flags & (EPOLLERR | EPOLLHUP)) != 0});
+        }
+        return n;
+    }
+  private:
+    int epoll_fd;
+    std::vector<epoll_event> ready;
+};
+#endif
+
+
+#ifdef KOMOB_HAS_KQUEUE
+class KqueueEventPoller: public EventPoller {
+  public:
+    KqueueEventPoller(): ready(256) {
+        kqueue_fd = ::kqueue();
+        if (kqueue_fd < 0) {
+            throw std::runtime_error("kqueue() failed");
+        }
+    }
+    ~KqueueEventPoller() override {
+        ::close(kqueue_fd);
+    }
+    void add(int fd) override {
+        struct kevent change;
+        EV_SET(&change, fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
+        if (::kevent(kqueue_fd, &change, 1, nullptr, 0, nullptr) < 0) {
+            throw std::runtime_error("kevent() failed");
+        }
+    }
+    void remove(int fd) override {
+        // one call per filter: the write filter is usually not there
+        struct kevent change;
+        EV_SET(&change, fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+        ::kevent(kqueue_fd, &change, 1, nullptr, 0, nullptr);
+        EV_SET(&change, fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+        ::kevent(kqueue_fd, &change, 1, nullptr, 0, nullptr);
+    }
+    void modify(int fd, bool readable, bool writable) override {
+        struct kevent change;
+        EV_SET(&change, fd, EVFILT_READ, readable ? EV_ENABLE : EV_DISABLE, 0, 0, nullptr);
+        ::kevent(kqueue_fd, &change, 1, nullptr, 0, nullptr);
+        EV_SET(&change, fd, EVFILT_WRITE, writable ? EV_ADD : EV_DELETE, 0, 0, nullptr);
+        ::kevent(kqueue_fd, &change, 1, nullptr, 0, nullptr);
+    }
+    int wait(int timeout_ms, std::vector<Event>& events) override {
+        events.clear();
+        timespec timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        int n = ::kevent(kqueue_fd, nullptr, 0, ready.data(), static_cast<int>(ready.size()), timeout_ms < 0 ? nullptr : &timeout);
+        for (int i = 0; i < n; i++) {
+            // EOF is reported as readable, so that the recv() returning 0 closes it
+            bool error = (ready[i].flags & EV_ERROR) != 0;
+            bool writing = (ready[i].filter == EVFILT_WRITE);
+            events.push_back(Event{static_cast<int>(ready[i].ident), ! error && ! writing, ! error && writing, error});
+        }
+        return n;
+    }
+  private:
+    int kqueue_fd;
+    std::vector<struct kevent> ready;
+};
+#endif
+
+
+inline std::unique_ptr<EventPoller> EventPoller::create(EventBackend backend)
+{
+    if (backend == EventBackend::Auto) {
+#if defined(KOMOB_HAS_EPOLL)
+        backend = EventBackend::Epoll;
+#elif defined(KOMOB_HAS_KQUEUE)
+        backend = EventBackend::Kqueue;
+#else
+        backend = EventBackend::Poll;
+#endif
+    }
+    
+    switch (backend) {
+#ifdef KOMOB_HAS_EPOLL
+      case EventBackend::Epoll:
+        return std::make_unique<EpollEventPoller>();
+#endif
+#ifdef KOMOB_HAS_KQUEUE
+      case EventBackend::Kqueue:
+        return std::make_unique<KqueueEventPoller>();
+#endif
+      case EventBackend::Poll:
+        return std::make_unique<PollEventPoller>();
+      default:
+        throw std::runtime_error("event backend not available on this platform");
+    }
+}
+
+
+
+// Bounded lock-free queue for any number of producers and consumers (D. Vyukov's algorithm)
+template<typename T, size_t Capacity>
+class BoundedQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+  public:
+    BoundedQueue() {
+        for (size_t i = 0; i < Capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    bool push(const T& value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence - position);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false;  // full
+            }
+            else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(T& value) {
+        size_t position = head.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & (Capacity - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+            if (diff == 0) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (diff < 0) {
+                return false;  // empty
+            }
+            else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->value;
+        cell->sequence.store(position + Capacity, std::memory_order_release);
+        return true;
+    }
+  private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    Cell cells[Capacity];
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+
+// Self-pipe to wake a sleeping thread; written only when the other side has announced that it sleeps
+class Wakeup {
+  public:
+    Wakeup() {
+        if (::pipe(fds) < 0) {
+            throw std::runtime_error("pipe() failed");
+        }
+        for (int fd: fds) {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+    }
+    ~Wakeup() {
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+    Wakeup(const Wakeup&) = delete;
+    Wakeup& operator=(const Wakeup&) = delete;
+    int fd() const { return fds[0]; }
+    // consumer: prepare(), check the queue again, then block on fd() (or call wait())
+    void prepare() {
+        sleeping.store(true, std::memory_order_seq_cst);
+    }
+    void awake() {
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+    void clear() {
+        awake();
+        char discard[64];
+        while (::read(fds[0], discard, sizeof(discard)) > 0) {
+            ;
+        }
+    }
+    void wait(int timeout_ms=-1) {
+        pollfd pfd{fds[0], POLLIN, 0};
+        ::poll(&pfd, 1, timeout_ms);
+        clear();
+    }
+    // producer: after pushing to the queue
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.exchange(false, std::memory_order_seq_cst)) {
+            char byte = 0;
+            (void) ! ::write(fds[1], &byte, 1);
+        }
+    }
+  private:
+    int fds[2];
+    std::atomic<bool> sleeping{false};
+};
+
+
+
+#ifdef KOMOB_USE_IO_URING
+// Minimal io_uring on the raw system calls; no liburing needed
+class IoUring {
+  public:
+    inline IoUring(unsigned entries, unsigned cq_entries);
+    inline ~IoUring() { release(); }
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    inline io_uring_sqe* get_sqe();
+    // submits the queued SQEs and waits for at least one completion (-ETIME on timeout)
+    inline int submit_and_wait(int timeout_ms);
+    template<class Handler> inline void for_each_completion(Handler handler);
+    // provided-buffer ring, group 0
+    inline void setup_buffers(unsigned count, unsigned size);
+    inline const uint8_t* buffer(unsigned id) const { return buffers.data() + static_cast<size_t>(id) * buffer_size; }
+    inline void recycle_buffer(unsigned id);
+    uint64_t recycled() const { return recycled_count; }  // buffers given back so far
+  private:
+    inline int submit(unsigned min_complete, int timeout_ms);
+    inline void release();
+  private:
+    int ring_fd = -1;
+    void *sq_ring = MAP_FAILED, *cq_ring = MAP_FAILED, *sqe_area = MAP_FAILED;
+    size_t sq_ring_size = 0, cq_ring_size = 0, sqe_area_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    unsigned sqe_tail = 0;  // local tail: SQEs prepared but not yet published
+    io_uring_buf* buf_ring = nullptr;  // not via io_uring_buf_ring::bufs, whose C++ layout is off by the empty-struct padding
+    uint16_t* buf_ring_tail = nullptr;
+    size_t buf_ring_size = 0;
+    unsigned buf_mask = 0, buffer_size = 0;
+    uint16_t buf_tail = 0;
+    uint64_t recycled_count = 0;
+    std::vector<uint8_t> buffers;
+};
+
+
+inline IoUring::IoUring(unsigned entries, unsigned cq_entries)
+{
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd < 0) {
+        throw std::runtime_error("io_uring_setup() failed");
+    }
+    if (! (params.features & IORING_FEAT_EXT_ARG)) {
+        release();
+        throw std::runtime_error("io_uring: kernel too old");
+    }
+    
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring != MAP_FAILED) {
+        cq_ring = single_mmap ? sq_ring : ::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    }
+    sqe_area_size = params.sq_entries * sizeof(io_uring_sqe);
+    if (cq_ring != MAP_FAILED) {
+        sqe_area = ::mmap(nullptr, sqe_area_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    }
+    if (sqe_area == MAP_FAILED) {
+        release();
+        throw std::runtime_error("io_uring: mmap() failed");
+    }
+    
+    uint8_t* sq = static_cast<uint8_t*>(sq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    uint8_t* cq = static_cast<uint8_t*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    sqes = static_cast<io_uring_sqe*>(sqe_area);
+    sqe_tail = *sq_tail;
+}
+
+
+inline void IoUring::release()
+{
+    if (buf_ring) {
+        ::munmap(buf_ring, buf_ring_size);
+    }
+    if (sqe_area != MAP_FAILED) {
+        ::munmap(sqe_area, sqe_area_size);
+    }
+    if ((cq_ring != MAP_FAILED) && (cq_ring != sq_ring)) {
+        ::munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != MAP_FAILED) {
+        ::munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0) {
+        ::close(ring_fd);
+    }
+}
+
+
+inline io_uring_sqe* IoUring::get_sqe()
+{
+    if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        submit(0, 0);  // full: flush what we have
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            throw std::runtime_error("io_uring: submission queue full");
+        }
+    }
+    unsigned index = sqe_tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sqe_tail++;
+    
+    return sqe;
+}
+
+
+inline int IoUring::submit(unsigned min_complete, int timeout_ms)
+{
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    
+    __kernel_timespec ts{timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    if ((min_complete > 0) && (timeout_ms >= 0)) {
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    
+    long result = ::syscall(
+        __NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+        (flags & IORING_ENTER_EXT_ARG) ? static_cast<void*>(&arg) : nullptr,
+        (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0
+    );
+    return (result < 0) ? -errno : static_cast<int>(result);
+}
+
+
+inline int IoUring::submit_and_wait(int timeout_ms)
+{
+    return submit(1, timeout_ms);
+}
+
+
+template<class Handler> inline void IoUring::for_each_completion(Handler handler)
+{
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_uring_cqe cqe = cqes[head & *cq_mask];
+        __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);  // the slot is free once copied
+        handler(cqe);
+    }
+}
+
+
+inline void IoUring::setup_buffers(unsigned count, unsigned size)
+{
+    // count must be a power of 2
+    buf_ring_size = count * sizeof(io_uring_buf);
+    void* area = ::mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        throw std::runtime_error("io_uring: mmap() failed");
+    }
+    buf_ring = static_cast<io_uring_buf*>(area);
+    buf_ring_tail = &static_cast<io_uring_buf_ring*>(area)->tail;
+    buf_mask = count - 1;
+    buffer_size = size;
+    buffers.resize(static_cast<size_t>(count) * size);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+    reg.ring_entries = count;
+    reg.bgid = 0;
+    if (::syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        throw std::runtime_error("io_uring: registering buffer ring failed");
+    }
+    for (unsigned id = 0; id < count; id++) {
+        recycle_buffer(id);
+    }
+}
+
+
+inline void IoUring::recycle_buffer(unsigned id)
+{
+    io_uring_buf* buf = &buf_ring[buf_tail & buf_mask];
+    buf->addr = reinterpret_cast<uint64_t>(buffer(id));
+    buf->len = buffer_size;
+    buf->bid = static_cast<uint16_t>(id);
+    __atomic_store_n(buf_ring_tail, ++buf_tail, __ATOMIC_RELEASE);
+    recycled_count++;
+}
+#endif
+        
+
+
+enum class LogLevel { Trace, Debug, Info, Warning, Error, Off };
+
+
+// Destination of the server log; write() is called by the logging thread, possibly by several at a time
+class LogSink {
+  public:
+    virtual ~LogSink() {}
+    virtual void write(LogLevel level, const char* message, size_t length) = 0;
+};
+
+
+// Default: std::cout, and std::cerr for warnings and errors, synchronously
+class StreamLogSink: public LogSink {
+  public:
+    void write(LogLevel level, const char* message, size_t length) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostream& stream = (level >= LogLevel::Warning) ? std::cerr : std::cout;
+        stream.write(message, static_cast<std::streamsize>(length)).put('\n');
+    }
+  private:
+    std::mutex mutex;
+};
+
+
+// Non-blocking: messages are copied into a lock-free ring and written to "output" later,
+// by a thread of its own every "drain_interval", or by drain() (from Server::every(), for example).
+// Messages arriving while the ring is full are dropped and counted.
+class RingLogSink: public LogSink {
+  public:
+    static constexpr size_t MAX_MESSAGE_LENGTH = 250;
+    inline RingLogSink(std::shared_ptr<LogSink> output, std::chrono::milliseconds drain_interval=std::chrono::milliseconds(10));
+    inline ~RingLogSink() override;
+    RingLogSink(const RingLogSink&) = delete;
+    RingLogSink& operator=(const RingLogSink&) = delete;
+    inline void write(LogLevel level, const char* message, size_t length) override;
+    inline size_t drain();
+    uint64_t dropped() const { return dropped_count.load(std::memory_order_relaxed); }
+  private:
+    struct Entry {
+        LogLevel level;
+        uint8_t length;
+        char text[MAX_MESSAGE_LENGTH];
+    };
+    BoundedQueue<Entry, 1024> ring;
+    std::shared_ptr<LogSink> output;
+    std::mutex drain_mutex;  // drain() may be called while the thread runs
+    std::atomic<uint64_t> dropped_count{0};
+    std::thread drainer;
+    std::mutex stop_mutex;
+    std::condition_variable stop_condition;
+    bool stop = false;
+};
+
+
+inline RingLogSink::RingLogSink(std::shared_ptr<LogSink> output_sink, std::chrono::milliseconds drain_interval)
+{
+    if (! output_sink) {
+        throw std::invalid_argument("RingLogSink: no output");
+    }
+    output = std::move(output_sink);
+    if (drain_interval.count() <= 0) {
+        return;  // drained by drain() only
+    }
+    drainer = std::thread([this, drain_interval]() {
+        std::unique_lock<std::mutex> lock(stop_mutex);
+        while (! stop_condition.wait_for(lock, drain_interval, [this]() { return stop; })) {
+            drain();
+        }
+    });
+}
+
+
+inline RingLogSink::~RingLogSink()
+{
+    if (drainer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(stop_mutex);
+            stop = true;
+        }
+        stop_condition.notify_one();
+        drainer.join();
+    }
+    drain();
+}
+
+
+inline void RingLogSink::write(LogLevel level, const char* message, size_t length)
+{
+    Entry entry;
+    entry.level = level;
+    entry.length = static_cast<uint8_t>(std::min(length, MAX_MESSAGE_LENGTH));
+    std::memcpy(entry.text, message, entry.length);
+    if (! ring.push(entry)) {
+        dropped_count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+inline size_t RingLogSink::drain()
+{
+    std::lock_guard<std::mutex> lock(drain_mutex);
+    size_t drained = 0;
+    Entry entry;
+    while (ring.pop(entry)) {
+        output->write(entry.level, entry.text, entry.length);
+        drained++;
+    }
+    return drained;
+}
+
+
+
+// Versions of register blocks, for the clients to read only the blocks changed since their last poll
+// (FC 0x41, Server::set_change_tracker()). The register writes by Modbus are recorded by the server;
+// a table whose values change by themselves calls changed(), from any thread, once the new values are readable.
+class ChangeTracker {
+  public:
+    inline ChangeTracker(unsigned start, unsigned count, unsigned block_size=16);
+    inline void changed(unsigned address, unsigned count=1);
+    inline uint32_t version();
+    // Bit i of "bitmap": the block at first_block(address) + i * block_size() has changed after "since";
+    // returns the current version. The range is to be within the tracked one.
+    inline uint32_t changed_blocks(uint32_t since, unsigned address, unsigned count, uint8_t* bitmap);
+    unsigned block_size() const { return block; }
+    unsigned first_block(unsigned address) const { return start_address + (address - start_address) / block * block; }
+    bool covers(unsigned address, unsigned count) const {
+        return (address >= start_address) && (uint64_t(address) + count <= uint64_t(start_address) + size);
+    }
+  private:
+    std::mutex mutex;  // a version is never seen before the block versions up to it
+    unsigned start_address, size, block;
+    uint32_t current = 0;  // wraps around; compared by difference
+    std::vector<uint32_t> versions;
+};
+
+
+inline ChangeTracker::ChangeTracker(unsigned start, unsigned count, unsigned block_size)
+{
+    if ((count == 0) || (block_size == 0)) {
+        throw std::invalid_argument("ChangeTracker: empty range or block");
+    }
+    start_address = start;
+    size = count;
+    block = block_size;
+    versions.assign((count + block_size - 1) / block_size, 0);
+}
+
+
+inline void ChangeTracker::changed(unsigned address, unsigned count)
+{
+    // clipped to the tracked range
+    uint64_t begin = std::max<uint64_t>(address, start_address);
+    uint64_t end = std::min<uint64_t>(uint64_t(address) + count, uint64_t(start_address) + size);
+    if (begin >= end) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    current++;
+    for (uint64_t i = (begin - start_address) / block; i <= (end - 1 - start_address) / block; i++) {
+        versions[i] = current;
+    }
+}
+
+
+inline uint32_t ChangeTracker::version()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return current;
+}
+
+
+inline uint32_t ChangeTracker::changed_blocks(uint32_t since, unsigned address, unsigned count, uint8_t* bitmap)
+{
+    unsigned first = (address - start_address) / block;
+    unsigned last = (address + count - 1 - start_address) / block;
+    std::memset(bitmap, 0, (last - first) / 8 + 1);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (unsigned i = first; i <= last; i++) {
+        if (static_cast<int32_t>(versions[i] - since) > 0) {
+            bitmap[(i - first) / 8] |= static_cast<uint8_t>(1u << ((i - first) % 8));
+        }
+    }
+    return current;
+}
+
+
+// Received bytes of every connection, appended to a file for a replay without sockets
+// (Server::set_capture(), examples/bench/modbus-replay). All big-endian: "KOMOBCAP", then records
+// [Time (8): nanoseconds since opening][Stream (4): connection number][Length (2)][Bytes];
+// a record without bytes marks the end of the stream (the connection has closed).
+class TrafficCapture {
+  public:
+    inline explicit TrafficCapture(const std::string& path);
+    inline ~TrafficCapture();
+    TrafficCapture(const TrafficCapture&) = delete;
+    TrafficCapture& operator=(const TrafficCapture&) = delete;
+    inline uint32_t open_stream();
+    inline void record(uint32_t stream, const uint8_t* data, size_t size);  // from any thread
+    void close_stream(uint32_t stream) { record(stream, nullptr, 0); }
+  private:
+    std::mutex mutex;
+    FILE* file;
+    std::chrono::steady_clock::time_point start;
+    uint32_t last_stream = 0;
+};
+
+
+inline TrafficCapture::TrafficCapture(const std::string& path)
+{
+    file = std::fopen(path.c_str(), "wb");
+    if (! file) {
+        throw std::runtime_error("TrafficCapture: unable to open " + path + ": " + std::strerror(errno));
+    }
+    std::fwrite("KOMOBCAP", 1, 8, file);
+    start = std::chrono::steady_clock::now();
+}
+
+
+inline TrafficCapture::~TrafficCapture()
+{
+    std::fclose(file);
+}
+
+
+inline uint32_t TrafficCapture::open_stream()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return ++last_stream;
+}
+
+
+inline void TrafficCapture::record(uint32_t stream, const uint8_t* data, size_t size)
+{
+    uint64_t time = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    uint8_t header[14];
+    for (unsigned i = 0; i < 8; i++) {
+        header[i] = static_cast<uint8_t>(time >> (56 - 8 * i));
+    }
+    for (unsigned i = 0; i < 4; i++) {
+        header[8 + i] = static_cast<uint8_t>(stream >> (24 - 8 * i));
+    }
+    header[12] = static_cast<uint8_t>(size >> 8);
+    header[13] = static_cast<uint8_t>(size);
+    std::lock_guard<std::mutex> lock(mutex);
+    std::fwrite(header, 1, sizeof(header), file);
+    if (size > 0) {
+        std::fwrite(data, 1, size, file);
+    }
+    std::fflush(file);  // complete up to the last record even if the server is killed
+}
+
+
+// Snapshot of the server counters, by Server::stats()
+struct ServerStats {
+    static constexpr unsigned LATENCY_BUCKETS = 16 + 40 * 8;
+    uint64_t requests = 0;
+    std::array<uint64_t, 256> requests_by_function{};  // by function code
+    uint64_t exceptions = 0;
+    std::array<uint64_t, 256> exceptions_by_code{};    // by exception code
+    uint64_t bytes_in = 0, bytes_out = 0;
+    uint64_t connections_accepted = 0, connections_active = 0;
+    std::vector<uint64_t> table_accesses;  // block calls per table, in the chain order
+    // time spent in dispatch_pdu(), in nanoseconds; log-linear buckets, 8 per power of two (HDR-style)
+    std::array<uint64_t, LATENCY_BUCKETS> latency_histogram{};
+    uint64_t latency_max_ns = 0;
+    
+    static unsigned latency_bucket(uint64_t ns) {
+        if (ns < 16) {
+            return static_cast<unsigned>(ns);
+        }
+        unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+        unsigned bucket = 16 + (msb - 4) * 8 + static_cast<unsigned>((ns >> (msb - 3)) & 7);
+        return std::min(bucket, LATENCY_BUCKETS - 1);
+    }
+    static uint64_t latency_bucket_end(unsigned bucket) {  // exclusive upper bound
+        if (bucket < 16) {
+            return bucket + 1;
+        }
+        unsigned msb = 4 + (bucket - 16) / 8;
+        return (static_cast<uint64_t>(8 + (bucket - 16) % 8 + 1)) << (msb - 3);
+    }
+    // upper bound of the bucket holding the given fraction (0.5, 0.99, ...) of the requests
+    uint64_t latency_percentile_ns(double fraction) const {
+        uint64_t total = 0;
+        for (uint64_t count: latency_histogram) {
+            total += count;
+        }
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(fraction * static_cast<double>(total) + 0.5);
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += latency_histogram[i];
+            if (seen >= rank) {
+                return std::min(latency_bucket_end(i), latency_max_ns);
+            }
+        }
+        return latency_max_ns;
+    }
+};
+
+
+class Server {
+  public:
+    Server(
+        std::shared_ptr<RegisterTable> register_table=nullptr,
+        DataWidth width=DataWidth::W32,
+        int keepalive_idle_sec=3600,
+        int packet_timeout_msec = 1000
+    );
+    inline Server& add(std::shared_ptr<RegisterTable> register_table);
+    inline Server& add(std::shared_ptr<RegisterTable> register_table, std::vector<AddressRange> ranges);
+    inline Server& add_unit(unsigned unit_id, std::shared_ptr<RegisterTable> register_table, std::vector<AddressRange> ranges={});
+    inline Server& set_unit_data_width(unsigned unit_id, DataWidth width);
+    inline Server& set_change_tracker(std::shared_ptr<ChangeTracker> tracker);
+    inline Server& set_unit_change_tracker(unsigned unit_id, std::shared_ptr<ChangeTracker> tracker);
+    inline Server& set_event_backend(EventBackend backend);
+    inline Server& set_threads(unsigned threads, Concurrency concurrency=Concurrency::Serialized);
+    inline Server& set_register_thread(bool enabled=true);
+    inline Server& set_diagnostic_registers(unsigned start);
+    inline Server& set_max_connections(unsigned max_connections, ConnectionPolicy policy=ConnectionPolicy::Reject);
+    inline Server& set_idle_timeout(int idle_timeout_sec);
+    inline Server& set_listen_backlog(int backlog);
+    // Listeners, instead of the default one on the port given to serve() (IPv4, any address):
+    // a numeric IPv4/IPv6 address ("::" for dual-stack), and a Unix-domain stream socket for local clients
+    inline Server& listen(const std::string& address, unsigned port);
+    inline Server& listen_unix(const std::string& path);
+    inline Server& set_output_high_water(size_t bytes);
+    inline Server& set_rate_limit(double requests_per_second, unsigned burst, RateLimitScope scope=RateLimitScope::Connection);
+    inline Server& set_requests_per_turn(unsigned requests);  // 0: no limit
+    inline Server& set_realtime(const RealtimeProfile& profile=RealtimeProfile());
+    inline Server& set_capture(std::shared_ptr<TrafficCapture> capture);  // records the received bytes
+    inline Server& every(std::chrono::milliseconds interval, std::function<void()> callback);
+    inline Server& set_log_sink(std::shared_ptr<LogSink> sink);
+    inline Server& set_log_level(LogLevel level);  // also while running, from any thread
+    inline ServerStats stats();
+    // Handles one request PDU (function code and data, without the MBAP header) as if received;
+    // for tests, benchmarks and replays. "response" needs room for MAX_RESPONSE_PDU_SIZE bytes.
+    static constexpr size_t MAX_RESPONSE_PDU_SIZE = 2 + 256;
+    inline size_t dispatch(const uint8_t* request, size_t size, uint8_t* response);
+    inline size_t dispatch(unsigned unit_id, const uint8_t* request, size_t size, uint8_t* response);
+    // A client byte stream without a socket, through the same frame parsing as a connection (for replays)
+    class Session;
+    inline int run(int argc, char** argv);
+    inline void serve(unsigned port=502);
+  private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t MAX_RESPONSE_SIZE = 7 + 2 + 256;  // MBAP + [FC][ByteCount] + 128 words
+    static constexpr size_t BUFFER_SIZE = 4096;
+#ifdef KOMOB_USE_IO_URING
+    static constexpr unsigned RING_BUFFERS = 256;  // provided buffers, shared by the connections of a loop
+    static constexpr unsigned PARKED_LIMIT = 8;    // parked buffers that make a connection stop receiving
+#endif
+    struct EventLoop;
+    struct Unit;
+    // token bucket of set_rate_limit(); shared by the connections from one address with RateLimitScope::Address
+    struct RateBucket {
+        std::mutex mutex;
+        double tokens;
+        Clock::time_point last;
+    };
+    // Fixed buffers only: no heap allocation per transaction
+    struct Connection {
+        int fd = -1;
+        EventLoop* loop = nullptr;
+        uint8_t buffer[BUFFER_SIZE];  // received bytes: pipelined frames, possibly ending with an incomplete one
+        size_t size = 0;              // bytes in the buffer
+        uint8_t output[BUFFER_SIZE];  // responses built in place, sent at once
+        size_t output_size = 0;
+        Clock::time_point deadline;  // for an incomplete frame
+        Connection *prev = nullptr, *next = nullptr;  // incomplete-frame list, ordered by deadline
+        Clock::time_point last_active;  // the last bytes received
+        Connection *idle_prev = nullptr, *idle_next = nullptr;  // least recently active first
+        bool admitted = false;  // counted in the connection limit
+        Connection *ready_prev = nullptr, *ready_next = nullptr;  // frames left by the per-turn limit, in turn order
+        std::shared_ptr<RateBucket> rate_bucket;  // null: no rate limit
+        size_t job_length = 0;  // frames handed to the register thread
+        bool busy = false;      // the register thread owns the frames and the output
+        bool paused = false;    // not in the poller
+        bool reading = true, writing = false;  // the poller interest
+        bool close_pending = false;
+        uint32_t capture_stream = 0;  // 0: not captured
+        // a read taken by RegisterTable::read_block_async(); the frames behind it wait
+        struct Deferred: Completion::Target {
+            Connection* connection = nullptr;
+            unsigned transaction_id, unit_id;
+            Unit* unit;
+            uint8_t function_code;
+            unsigned start, count;
+            unsigned values[128];
+            bool success;
+            Clock::time_point started;
+            inline void complete(bool success) override;
+        } deferred;
+        bool deferring = false;
+#ifdef KOMOB_USE_IO_URING
+        uint32_t id = 0;                // to tell completions for a reused fd
+        bool receiving = false, sending = false, closing = false;
+        uint8_t in_flight[BUFFER_SIZE];  // being sent, while "output" collects the next responses
+        size_t in_flight_size = 0, sent = 0;
+        // received buffers not fitting in "buffer" yet; room for all, as a recv may deliver more after the limit
+        struct { uint16_t id, length; } parked[RING_BUFFERS];
+        unsigned parked_count = 0;
+        bool receive_paused = false;   // the recv cancelled at PARKED_LIMIT, armed again once they are taken
+        bool receive_starved = false;  // the recv ended with no buffer left, armed again once some are returned
+#endif
+    };
+    // One per thread; a connection stays in the loop that accepted it
+    struct EventLoop {
+        std::vector<int> listen_fds;  // in the order of listen_addresses
+        std::unique_ptr<EventPoller> poller;
+        std::vector<Connection*> connections;  // by fd; null: none
+        // with set_realtime(), the connections are taken from slots allocated before the memory is locked
+        std::unique_ptr<Connection[]> pool;
+        std::vector<Connection*> free_slots;
+        Connection *incomplete_head = nullptr, *incomplete_tail = nullptr;
+        Connection *idle_head = nullptr, *idle_tail = nullptr;
+        Connection *ready_head = nullptr, *ready_tail = nullptr;
+        unsigned requests_per_turn = 0;  // 0: all the complete frames at once
+        // register thread -> this loop
+        std::unique_ptr<BoundedQueue<Connection*, 1024>> completions;
+        std::unique_ptr<Wakeup> wakeup;
+        unsigned jobs_in_flight = 0;
+        std::vector<Connection*> waiting;  // the job queue was full
+        std::vector<Connection*> retrying;  // "waiting" of the previous round, being submitted again
+        // completed deferred reads -> this loop; no more reads are deferred while the queue could overflow
+        std::unique_ptr<BoundedQueue<Connection*, 1024>> resumed;
+        unsigned deferred_count = 0;
+        bool runs_timers = false;
+        // each counter has a single writer (this loop, or the thread running dispatch_pdu())
+        struct Counters {
+            std::atomic<uint64_t> requests[256]{}, exceptions[256]{};
+            std::atomic<uint64_t> bytes_in{0}, bytes_out{0}, accepted{0}, closed{0};
+            std::atomic<uint64_t> latency[ServerStats::LATENCY_BUCKETS]{};
+            std::atomic<uint64_t> latency_max{0};
+        } counters;
+        ~EventLoop() {
+            if (! pool) {
+                for (Connection* connection: connections) {
+                    delete connection;
+                }
+            }
+        }
+    };
+    static void count(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    // read-only registers with the counters, by set_diagnostic_registers(); writes are refused, not passed on
+    class DiagnosticTable: public RegisterTable {
+      public:
+        static constexpr unsigned SIZE = 16 + 128 + 1;
+        DiagnosticTable(Server* server, unsigned start): server(server), start(start) {}
+        inline unsigned read_block(unsigned address, unsigned count, unsigned* values) override;
+        unsigned write_block(unsigned /*start*/, unsigned /*count*/, const unsigned* /*values*/) override { throw IllegalAddress(); }
+        unsigned write_coils(unsigned /*start*/, unsigned /*count*/, const uint8_t* /*bits*/) override { throw IllegalAddress(); }
+      private:
+        Server* server;
+        unsigned start;
+    };
+  private:
+    inline void set_nonblocking(int fd);
+    inline void set_keepalive(int fd, int idle, int interval, int count);
+    inline void set_client_options(int fd, bool tcp);
+    inline void prepare_realtime_memory();
+    inline void enter_realtime_thread(unsigned index);
+    struct ListenAddress {
+        std::string address;  // empty: IPv4 any address
+        unsigned port;
+        std::string path;  // non-empty: Unix-domain socket
+    };
+    inline int open_listener(const ListenAddress& listen_address, bool reuse_port);
+    static inline std::string describe(const ListenAddress& listen_address);
+    static inline void describe_peer(const sockaddr_storage& peer, char* text, size_t size);
+    inline void run_loop(EventLoop& loop);
+    inline void accept_all(EventLoop& loop, int listen_fd);
+    inline void close_connection(Connection& connection);
+    inline bool admit(EventLoop& loop);
+    inline Connection& add_connection(EventLoop& loop, int fd);
+    inline void remove_connection(EventLoop& loop, int fd);
+    static Connection* find_connection(EventLoop& loop, int fd) {
+        return ((fd >= 0) && (size_t(fd) < loop.connections.size())) ? loop.connections[fd] : nullptr;
+    }
+    inline void attach_rate_limit(Connection& connection, const sockaddr_storage& peer);
+    inline bool take_token(RateBucket& bucket);
+    inline void release(Connection& connection);
+    inline void close_any(Connection& connection);
+    inline int wait_timeout_ms(const EventLoop& loop);
+    static inline int timeout_ms_until(Clock::time_point deadline);
+    inline void run_timers();
+    inline void close_expired(EventLoop& loop);
+    inline bool receive(Connection& connection);
+    bool logging(LogLevel level) const { return level >= log_level.load(std::memory_order_relaxed); }
+    inline void log(LogLevel level, const char* message);
+    template<typename... Args> inline void log(LogLevel level, const char* format, Args... args);
+    inline bool respond(Connection& connection);
+    inline bool flush(Connection& connection);
+    inline void update_interest(Connection& connection);
+    inline bool process_frames(Connection& connection);
+    inline void submit_job(Connection& connection);
+    inline void run_register_thread();
+    inline void complete_job(Connection& connection);
+    inline void resume(Connection& connection);
+#ifdef KOMOB_USE_IO_URING
+    inline void serve_io_uring(EventLoop& loop);
+    inline void close_io_uring(Connection& connection);
+    inline void submit_send(IoUring& ring, Connection& connection);
+    inline bool pump_io_uring(IoUring& ring, Connection& connection);
+    enum : uint64_t { OP_ACCEPT = 1, OP_RECV = 2, OP_SEND = 3, OP_CANCEL = 4 };
+    static uint64_t user_data(uint64_t op, int fd, uint32_t id) {
+        return op | (static_cast<uint64_t>(fd) << 8) | (static_cast<uint64_t>(id) << 32);
+    }
+#endif
+    // The tables and the data width behind a unit ID
+    struct Unit {
+        RegisterChain chain;
+        DataWidth data_width;
+        std::shared_ptr<ChangeTracker> changes;  // for FC 0x41; null: not available
+    };
+    inline Unit& unit_for(unsigned unit_id);
+    inline bool frame_length(const uint8_t* header, size_t& length);
+    inline void handle_single_request(Connection& connection, const uint8_t* frame, size_t length);
+    inline void finish_response(Connection& connection, unsigned transaction_id, unsigned unit_id, unsigned function_code, Clock::time_point started, size_t resp_pdu_size);
+    static constexpr size_t PDU_DEFERRED = 0;  // from dispatch_pdu(): the response comes from resume()
+    inline size_t dispatch_pdu(Unit& unit, const uint8_t* request, size_t size, uint8_t* response, Connection::Deferred* deferred=nullptr);
+    inline size_t exception_pdu(uint8_t* response, uint8_t function_code, uint8_t exception_code);
+    inline bool read_registers(Unit& unit, unsigned start, unsigned count, unsigned* values);
+    inline bool write_registers(Unit& unit, unsigned start, unsigned count, const unsigned* values);
+    inline size_t read_holding_registers(Unit& unit, const uint8_t* request, size_t size, uint8_t* response, Connection::Deferred* deferred);
+    inline size_t registers_response(Unit& unit, uint8_t function_code, unsigned start, unsigned count, const unsigned* values, uint8_t* response);
+    inline size_t read_bits(Unit& unit, const uint8_t* request, size_t size, uint8_t* response);
+    inline size_t write_single_coil(Unit& unit, const uint8_t* request, size_t size, uint8_t* response);
+    inline size_t write_multiple_coils(Unit& unit, const uint8_t* request, size_t size, uint8_t* response);
+    inline size_t write_single_register(Unit& unit, const uint8_t* request, size_t size, uint8_t* response);
+    inline size_t write_multiple_registers(Unit& unit, const uint8_t* request, size_t size, uint8_t* response);
+    inline size_t read_write_multiple_registers(Unit& unit, const uint8_t* request, size_t size, uint8_t* response);
+    inline size_t read_changed_blocks(Unit& unit, const uint8_t* request, size_t size, uint8_t* response);
+  private:
+    int keepalive_idle, keepalive_interval, keepalive_count;
+    int timeout_ms;
+    Unit default_unit;  // the tables by add(), for the unit IDs not routed by add_unit()
+    std::vector<std::unique_ptr<Unit>> routed_units;
+    std::array<Unit*, 256> unit_routes;
+    EventBackend event_backend;
+    unsigned threads;
+    Concurrency concurrency;
+    std::mutex access_mutex;  // for Concurrency::Serialized with several threads
+    bool serialize_access = false;
+    bool register_thread;
+    // event loops -> register thread
+    std::unique_ptr<BoundedQueue<Connection*, 1024>> jobs;
+    std::unique_ptr<Wakeup> jobs_wakeup;
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    std::mutex loops_mutex;  // for stats() from other threads
+    unsigned max_connections;  // 0: no limit
+    ConnectionPolicy connection_policy;
+    std::atomic<unsigned> connection_count{0};  // over all the loops
+    int idle_timeout_ms;  // 0: no timeout
+    int listen_backlog;
+    std::vector<ListenAddress> listen_addresses;  // by listen() and listen_unix()
+    double rate_limit;  // requests per second; 0: no limit
+    double rate_burst;
+    RateLimitScope rate_scope;
+    std::mutex rate_mutex;  // for rate_buckets, from any loop
+    std::unordered_map<std::string, std::weak_ptr<RateBucket>> rate_buckets;  // by client address
+    size_t rate_sweep_at = 64;
+    unsigned requests_per_turn;
+    bool realtime = false;
+    RealtimeProfile realtime_profile;
+    std::shared_ptr<TrafficCapture> capture;
+    size_t output_high_water;  // unsent bytes above which no more requests are taken from that client
+    // every(): a min-heap by the next deadline, run by the thread making the register accesses
+    struct Timer {
+        Clock::time_point next;
+        Clock::duration interval;
+        std::function<void()> callback;
+    };
+    std::vector<Timer> timers;
+    std::shared_ptr<LogSink> log_sink;
+    std::atomic<LogLevel> log_level{LogLevel::Info};
+
+  private:
+    static constexpr uint8_t EX_ILLEGAL_FUNCTION = 0x01;
+    static constexpr uint8_t EX_ILLEGAL_ADDRESS  = 0x02;
+    static constexpr uint8_t EX_ILLEGAL_VALUE    = 0x03;
+    static constexpr uint8_t EX_SLAVE_FAILURE    = 0x04;
+    static constexpr uint8_t EX_SLAVE_BUSY       = 0x06;  // over the rate limit
+    static constexpr uint8_t EX_GATEWAY_PATH     = 0x0a;  // Gateway Path Unavailable
+    static constexpr uint8_t FC_READ_COILS               = 0x01;
+    static constexpr uint8_t FC_READ_DISCRETE_INPUTS     = 0x02;
+    static constexpr uint8_t FC_READ_HOLDING_REGISTERS   = 0x03;
+    static constexpr uint8_t FC_READ_INPUT_REGISTERS     = 0x04;
+    static constexpr uint8_t FC_WRITE_SINGLE_COIL        = 0x05;
+    static constexpr uint8_t FC_WRITE_SINGLE_REGISTER    = 0x06;
+    static constexpr uint8_t FC_WRITE_MULTIPLE_COILS     = 0x0f;
+    static constexpr uint8_t FC_WRITE_MULTIPLE_REGISTERS = 0x10;
+    static constexpr uint8_t FC_READ_WRITE_MULTIPLE_REGISTERS = 0x17;
+    static constexpr uint8_t FC_READ_CHANGED_BLOCKS      = 0x41;  // vendor-specific (user-defined function code range)
+    
+    inline uint16_t get_u16(const uint8_t* p) {
+        return static_cast<uint16_t>((p[0] << 8) | p[1]);
+    }
+    inline void put_u16(uint8_t* p, uint16_t v) {
+        p[0] = static_cast<uint8_t>((v >> 8) & 0xff);
+        p[1] = static_cast<uint8_t>(v & 0xff);
+    }
+    inline void link_incomplete(Connection& connection) {
+        EventLoop& loop = *connection.loop;
+        connection.prev = loop.incomplete_tail;
+        connection.next = nullptr;
+        (loop.incomplete_tail ? loop.incomplete_tail->next : loop.incomplete_head) = &connection;
+        loop.incomplete_tail = &connection;
+    }
+    inline bool is_incomplete(const Connection& connection) {
+        return connection.prev || (connection.loop->incomplete_head == &connection);
+    }
+    inline void unlink_incomplete(Connection& connection) {
+        if (! is_incomplete(connection)) {
+            return;
+        }
+        EventLoop& loop = *connection.loop;
+        (connection.prev ? connection.prev->next : loop.incomplete_head) = connection.next;
+        (connection.next ? connection.next->prev : loop.incomplete_tail) = connection.prev;
+        connection.prev = connection.next = nullptr;
+    }
+    inline void touch(Connection& connection) {
+        // moved to the tail of the idle list: the head is the least recently active one
+        unlink_idle(connection);
+        EventLoop& loop = *connection.loop;
+        connection.last_active = Clock::now();
+        connection.idle_prev = loop.idle_tail;
+        connection.idle_next = nullptr;
+        (loop.idle_tail ? loop.idle_tail->idle_next : loop.idle_head) = &connection;
+        loop.idle_tail = &connection;
+    }
+    inline void unlink_idle(Connection& connection) {
+        EventLoop& loop = *connection.loop;
+        if (! connection.idle_prev && (loop.idle_head != &connection)) {
+            return;
+        }
+        (connection.idle_prev ? connection.idle_prev->idle_next : loop.idle_head) = connection.idle_next;
+        (connection.idle_next ? connection.idle_next->idle_prev : loop.idle_tail) = connection.idle_prev;
+        connection.idle_prev = connection.idle_next = nullptr;
+    }
+    inline void link_ready(Connection& connection) {
+        EventLoop& loop = *connection.loop;
+        connection.ready_prev = loop.ready_tail;
+        connection.ready_next = nullptr;
+        (loop.ready_tail ? loop.ready_tail->ready_next : loop.ready_head) = &connection;
+        loop.ready_tail = &connection;
+    }
+    inline bool is_ready(const Connection& connection) {
+        return connection.ready_prev || (connection.loop->ready_head == &connection);
+    }
+    inline void unlink_ready(Connection& connection) {
+        if (! is_ready(connection)) {
+            return;
+        }
+        EventLoop& loop = *connection.loop;
+        (connection.ready_prev ? connection.ready_prev->ready_next : loop.ready_head) = connection.ready_next;
+        (connection.ready_next ? connection.ready_next->ready_prev : loop.ready_tail) = connection.ready_prev;
+        connection.ready_prev = connection.ready_next = nullptr;
+    }
+};
+
+
+// Received bytes in, responses out, in the calling thread: every complete frame is handled as on a connection
+// (without the rate limit, the per-turn limit and the deferred reads)
+class Server::Session {
+  public:
+    explicit Session(Server& server): server(server) {
+        connection.loop = &loop;
+        connection.deferred.connection = &connection;
+    }
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+    // Appends the responses to "responses". False: the stream is broken (not Modbus, or a frame too long)
+    // and the server would close the connection; the rest is dropped, and the next feed() starts a new stream.
+    inline bool feed(const uint8_t* data, size_t size, std::vector<uint8_t>& responses);
+    size_t pending() const { return connection.size; }  // bytes of an incomplete frame
+  private:
+    Server& server;
+    EventLoop loop;
+    Connection connection;
+};
+
+
+
+inline void RegisterChain::add(std::shared_ptr<RegisterTable> register_table, std::vector<AddressRange> ranges, bool front)
+{
+    ranges.erase(
+        std::remove_if(ranges.begin(), ranges.end(), [](const AddressRange& range) { return range.count == 0; }),
+        ranges.end()
+    );
+    std::shared_ptr<std::mutex> mutex;
+    for (const auto& entry: entries) {
+        if (entry.table == register_table) {
+            mutex = entry.mutex;
+        }
+    }
+    if (! mutex) {
+        mutex = std::make_shared<std::mutex>();
+    }
+    Entry entry{register_table, std::move(ranges), mutex, std::make_shared<std::atomic<uint64_t>>(0)};
+    entries.insert(front ? entries.begin() : entries.end(), std::move(entry));
+    build_routes();
+}
+
+
+inline std::vector<uint64_t> RegisterChain::access_counts() const
+{
+    std::vector<uint64_t> counts;
+    for (const auto& entry: entries) {
+        counts.push_back(entry.accesses->load(std::memory_order_relaxed));
+    }
+    return counts;
+}
+
+
+inline void RegisterChain::build_routes()
+{
+    // Route boundaries are where any declared range starts or ends
+    std::vector<uint64_t> boundaries{0};
+    for (const auto& entry: entries) {
+        for (const auto& range: entry.ranges) {
+            boundaries.push_back(range.start);
+            boundaries.push_back(static_cast<uint64_t>(range.start) + range.count);
+        }
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+    routes.clear();
+    for (uint64_t boundary: boundaries) {
+        if (boundary > std::numeric_limits<unsigned>::max()) {
+            break;
+        }
+        Route route{static_cast<unsigned>(boundary), {}};
+        for (const auto& entry: entries) {
+            bool covered = entry.ranges.empty();
+            for (const auto& range: entry.ranges) {
+                if ((boundary >= range.start) && (boundary < static_cast<uint64_t>(range.start) + range.count)) {
+                    covered = true;
+                    break;
+                }
+            }
+            if (covered) {
+                route.tables.push_back(Link{entry.table.get(), entry.mutex.get(), entry.accesses.get(), ! entry.ranges.empty()});
+            }
+        }
+        if (! routes.empty() && (routes.back().tables == route.tables)) {
+            continue;  // same chain as the previous one: merged
+        }
+        routes.push_back(std::move(route));
+    }
+}
+
+
+inline const RegisterChain::Route& RegisterChain::find_route(unsigned address, uint64_t& end) const
+{
+    auto next = std::upper_bound(
+        routes.begin(), routes.end(), address, 
+        [](unsigned address, const Route& route) { return address < route.start; }
+    );
+    end = (next == routes.end()) ? std::numeric_limits<uint64_t>::max() : next->start;
+    return *(next - 1);  // routes[0].start is 0
+}
+
+
+template<typename BlockAccess>
+inline bool RegisterChain::access(unsigned start, unsigned count, BlockAccess block_access)
+{
+    // Chain-of-Responsibility over blocks: the chain restarts at the first address not handled.
+    // A table without ranges declining an address may still handle the next ones, so the tables behind it
+    // get that address only: per-address precedence, as with read()/write().
+    // For writes, the values before a failing address have been passed to the tables already (see write_batch()).
+    unsigned done = 0;
+    while (done < count) {
+        uint64_t end;
+        const Route& route = find_route(start + done, end);
+        unsigned length = static_cast<unsigned>(std::min<uint64_t>(count - done, end - (start + done)));
+        unsigned handled = 0;
+        for (const Link& link: route.tables) {
+            std::unique_lock<std::mutex> lock;
+            if (lock_tables) {
+                lock = std::unique_lock<std::mutex>(*link.mutex);
+            }
+            link.accesses->fetch_add(1, std::memory_order_relaxed);
+            try {
+                handled = block_access(link, start + done, length, done);
+            }
+            catch (const IllegalAddress&) {
+                return false;  // refused: not offered to the next tables
+            }
+            if (handled > 0) {
+                break;
+            }
+            if (! link.declared) {
+                length = 1;
+            }
+        }
+        if (handled == 0) {
+            return false;
+        }
+        done += handled;
+    }
+    
+    return true;
+}
+
+
+template<typename BlockAccess>
+inline bool RegisterChain::write_batch(unsigned start, unsigned count, BlockAccess block_access)
+{
+    // The tables offered a part of the write, each once, in the order of their first part
+    Link batch[MAX_BATCH_TABLES];
+    unsigned size = 0;
+    bool done;
+    try {
+        done = access(start, count, [&](const Link& link, unsigned address, unsigned length, unsigned offset) {
+            if (std::find(batch, batch + size, link) == batch + size) {
+                if (size == MAX_BATCH_TABLES) {
+                    throw std::runtime_error("too many register tables in one write");
+                }
+                batch[size++] = link;
+                link.table->begin_batch();  // under the table lock taken by access()
+            }
+            return block_access(link.table, address, length, offset);
+        });
+    }
+    catch (...) {
+        end_batch(batch, size, false);
+        throw;
+    }
+    end_batch(batch, size, done);
+    
+    return done;
+}
+
+
+inline void RegisterChain::end_batch(const Link* batch, unsigned size, bool commit)
+{
+    // A commit() failure aborts the tables not committed yet; the ones already committed stay so
+    unsigned i = 0;
+    auto finish = [this](const Link& link, bool committing) {
+        std::unique_lock<std::mutex> lock;
+        if (lock_tables) {
+            lock = std::unique_lock<std::mutex>(*link.mutex);
+        }
+        if (committing) {
+            link.table->commit();
+        }
+        else {
+            link.table->abort();
+        }
+    };
+    try {
+        for (; i < size; i++) {
+            finish(batch[i], commit);
+        }
+    }
+    catch (...) {
+        for (i++; i < size; i++) {
+            finish(batch[i], false);
+        }
+        throw;
+    }
+}
+
+
+inline bool RegisterChain::read(unsigned start, unsigned count, unsigned* values)
+{
+    return access(start, count, [values](const Link& link, unsigned address, unsigned length, unsigned offset) {
+        return link.table->read_block(address, length, values + offset);
+    });
+}
+
+
+inline bool RegisterChain::write(unsigned start, unsigned count, const unsigned* values)
+{
+    return write_batch(start, count, [values](RegisterTable* table, unsigned address, unsigned length, unsigned offset) {
+        return table->write_block(address, length, values + offset);
+    });
+}
+
+
+inline bool RegisterChain::read_inputs(unsigned start, unsigned count, unsigned* values)
+{
+    return access(start, count, [values](const Link& link, unsigned address, unsigned length, unsigned offset) {
+        return link.table->read_input_block(address, length, values + offset);
+    });
+}
+
+
+inline bool RegisterChain::read_coils(unsigned start, unsigned count, uint8_t* bits)
+{
+    return access(start, count, [bits](const Link& link, unsigned address, unsigned length, unsigned offset) {
+        return link.table->read_coils(address, length, bits + offset);
+    });
+}
+
+
+inline bool RegisterChain::write_coils(unsigned start, unsigned count, const uint8_t* bits)
+{
+    return write_batch(start, count, [bits](RegisterTable* table, unsigned address, unsigned length, unsigned offset) {
+        return table->write_coils(address, length, bits + offset);
+    });
+}
+
+
+inline bool RegisterChain::read_discrete_inputs(unsigned start, unsigned count, uint8_t* bits)
+{
+    return access(start, count, [bits](const Link& link, unsigned address, unsigned length, unsigned offset) {
+        return link.table->read_discrete_inputs(address, length, bits + offset);
+    });
+}
+
+
+inline bool RegisterChain::read_async(unsigned start, unsigned count, unsigned* values, bool input, Completion completion, bool& taken)
+{
+    // The tables are asked in the chain order, as for a synchronous read; at the start address, each is offered
+    // the whole read first (if within one route), and the walk stops at the first table taking or serving it.
+    // Returns whether the read has been served, or taken.
+    uint64_t end;
+    find_route(start, end);
+    bool offered = (end >= uint64_t(start) + count);
+    taken = false;
+    return access(start, count, [&](const Link& link, unsigned address, unsigned length, unsigned offset) {
+        if (offered && (offset == 0)) {
+            taken = input ? link.table->read_input_block_async(start, count, values, completion) : link.table->read_block_async(start, count, values, completion);
+            if (taken) {
+                return count;  // the rest of the walk is done
+            }
+        }
+        return input ? link.table->read_input_block(address, length, values + offset) : link.table->read_block(address, length, values + offset);
+    });
+}
+
+
+
+inline Server::Server(std::shared_ptr<RegisterTable> register_table, DataWidth width, int keepalive_idle_sec, int packet_timeout_ms)
+{
+    if (register_table) {
+        default_unit.chain.add(register_table);
+    }
+
+    default_unit.data_width = width;
+    unit_routes.fill(&default_unit);
+    
+    keepalive_idle = keepalive_idle_sec;
+    keepalive_interval = 30;
+    keepalive_count = 3;
+    
+    timeout_ms = packet_timeout_ms;
+    
+    event_backend = EventBackend::Auto;
+    threads = 1;
+    concurrency = Concurrency::Serialized;
+    register_thread = false;
+    
+    max_connections = 0;
+    connection_policy = ConnectionPolicy::Reject;
+    idle_timeout_ms = 0;
+    listen_backlog = 16;
+    output_high_water = BUFFER_SIZE;
+    rate_limit = 0;
+    rate_burst = 1;
+    rate_scope = RateLimitScope::Connection;
+    requests_per_turn = 0;
+    log_sink = std::make_shared<StreamLogSink>();
+}
+    
+    
+inline Server& Server::add(std::shared_ptr<RegisterTable> register_table)
+{
+    if (register_table) {
+        default_unit.chain.add(register_table);
+    }
+    return *this;
+}
+
+
+inline Server& Server::add(std::shared_ptr<RegisterTable> register_table, std::vector<AddressRange> ranges)
+{
+    // The table is called only for addresses in the ranges
+    if (register_table) {
+        default_unit.chain.add(register_table, std::move(ranges));
+    }
+    return *this;
+}
+
+
+inline Server& Server::add_unit(unsigned unit_id, std::shared_ptr<RegisterTable> register_table, std::vector<AddressRange> ranges)
+{
+    // Requests with this unit ID go to the tables added here instead of the default ones
+    if (unit_id > 255) {
+        throw std::invalid_argument("add_unit(): unit ID must be 0 to 255");
+    }
+    if (unit_routes[unit_id] == &default_unit) {
+        routed_units.push_back(std::make_unique<Unit>());
+        routed_units.back()->data_width = default_unit.data_width;
+        unit_routes[unit_id] = routed_units.back().get();
+    }
+    if (register_table) {
+        unit_routes[unit_id]->chain.add(register_table, std::move(ranges));
+    }
+    return *this;
+}
+
+
+inline Server& Server::set_unit_data_width(unsigned unit_id, DataWidth width)
+{
+    if (unit_id > 255) {
+        throw std::invalid_argument("set_unit_data_width(): unit ID must be 0 to 255");
+    }
+    add_unit(unit_id, nullptr);
+    unit_routes[unit_id]->data_width = width;
+    return *this;
+}
+
+
+inline Server& Server::set_change_tracker(std::shared_ptr<ChangeTracker> tracker)
+{
+    default_unit.changes = std::move(tracker);
+    return *this;
+}
+
+
+inline Server& Server::set_unit_change_tracker(unsigned unit_id, std::shared_ptr<ChangeTracker> tracker)
+{
+    if (unit_id > 255) {
+        throw std::invalid_argument("set_unit_change_tracker(): unit ID must be 0 to 255");
+    }
+    add_unit(unit_id, nullptr);
+    unit_routes[unit_id]->changes = std::move(tracker);
+    return *this;
+}
+
+
+inline Server::Unit& Server::unit_for(unsigned unit_id)
+{
+    return *unit_routes[unit_id & 0xff];
+}
+    
+
+inline Server& Server::set_event_backend(EventBackend backend)
+{
+    event_backend = backend;
+    return *this;
+}
+
+
+inline Server& Server::set_threads(unsigned number_of_threads, Concurrency table_concurrency)
+{
+    // Each thread runs its own event loop with its own listener (SO_REUSEPORT) where possible
+    threads = (number_of_threads > 0) ? number_of_threads : 1;
+    concurrency = table_concurrency;
+    return *this;
+}
+
+
+inline Server& Server::set_register_thread(bool enabled)
+{
+    // The register tables are called only from one dedicated thread; the event loops keep
+    // accepting and parsing while a slow table is being accessed
+    register_thread = enabled;
+    return *this;
+}
+
+
+inline Server& Server::set_max_connections(unsigned max, ConnectionPolicy policy)
+{
+    // 0 for no limit; over all the threads
+    max_connections = max;
+    connection_policy = policy;
+    return *this;
+}
+
+
+inline Server& Server::set_idle_timeout(int idle_timeout_sec)
+{
+    // connections receiving nothing for this long are closed; 0 for no timeout
+    idle_timeout_ms = (idle_timeout_sec > 0) ? 1000 * idle_timeout_sec : 0;
+    return *this;
+}
+
+
+inline Server& Server::listen(const std::string& address, unsigned port)
+{
+    listen_addresses.push_back(ListenAddress{address, port, ""});
+    return *this;
+}
+
+
+inline Server& Server::listen_unix(const std::string& path)
+{
+    if (path.size() >= sizeof(sockaddr_un::sun_path)) {
+        throw std::runtime_error("Unix socket path too long: " + path);
+    }
+    listen_addresses.push_back(ListenAddress{"", 0, path});
+    return *this;
+}
+
+
+inline Server& Server::set_listen_backlog(int backlog)
+{
+    listen_backlog = (backlog > 0) ? backlog : 16;
+    return *this;
+}
+
+
+inline Server& Server::set_output_high_water(size_t bytes)
+{
+    // at least one response; at most the output buffer
+    output_high_water = std::min(std::max(bytes, MAX_RESPONSE_SIZE), BUFFER_SIZE);
+    return *this;
+}
+
+
+inline Server& Server::set_rate_limit(double requests_per_second, unsigned burst, RateLimitScope scope)
+{
+    // requests over the limit are answered with "Slave Device Busy", without accessing the tables
+    rate_limit = std::max(requests_per_second, 0.0);
+    rate_burst = std::max(burst, 1u);
+    rate_scope = scope;
+    return *this;
+}
+
+
+inline Server& Server::set_realtime(const RealtimeProfile& profile)
+{
+    realtime = true;
+    realtime_profile = profile;
+    return *this;
+}
+
+
+inline Server& Server::set_capture(std::shared_ptr<TrafficCapture> traffic_capture)
+{
+    // the connections accepted from now on
+    capture = std::move(traffic_capture);
+    return *this;
+}
+
+
+inline Server& Server::set_requests_per_turn(unsigned requests)
+{
+    // pipelined requests of a connection handled before the other ready connections get their turn
+    requests_per_turn = requests;
+    return *this;
+}
+
+
+inline Server& Server::set_log_sink(std::shared_ptr<LogSink> sink)
+{
+    // to be called before run() / serve()
+    log_sink = sink ? std::move(sink) : std::make_shared<StreamLogSink>();
+    return *this;
+}
+
+
+inline Server& Server::set_log_level(LogLevel level)
+{
+    // LogLevel::Trace shows every request and register value
+    log_level.store(level, std::memory_order_relaxed);
+    return *this;
+}
+
+
+inline void Server::log(LogLevel level, const char* message)
+{
+    if (logging(level)) {
+        log_sink->write(level, message, std::strlen(message));
+    }
+}
+
+
+template<typename... Args>
+inline void Server::log(LogLevel level, const char* format, Args... args)
+{
+    // formatted only if enabled; no allocation
+    if (! logging(level)) {
+        return;
+    }
+    char message[256];
+    int length = std::snprintf(message, sizeof(message), format, args...);
+    if (length > 0) {
+        log_sink->write(level, message, std::min(static_cast<size_t>(length), sizeof(message) - 1));
+    }
+}
+
+
+inline Server& Server::every(std::chrono::milliseconds interval, std::function<void()> callback)
+{
+    // to be called before run() / serve()
+    if (interval.count() <= 0) {
+        throw std::invalid_argument("every(): interval must be positive");
+    }
+    timers.push_back(Timer{Clock::now() + interval, interval, std::move(callback)});
+    std::push_heap(timers.begin(), timers.end(), [](const Timer& a, const Timer& b) { return a.next > b.next; });
+    return *this;
+}
+
+
+inline Server& Server::set_diagnostic_registers(unsigned start)
+{
+    // ahead of the user tables, so that a catch-all table does not hide them
+    default_unit.chain.add(std::make_shared<DiagnosticTable>(this, start), {{start, DiagnosticTable::SIZE}}, true);
+    return *this;
+}
+
+
+inline size_t Server::dispatch(const uint8_t* request, size_t size, uint8_t* response)
+{
+    try {
+        std::unique_lock<std::mutex> lock(access_mutex, std::defer_lock);
+        if (serialize_access) {
+            lock.lock();
+        }
+        return dispatch_pdu(default_unit, request, size, response);
+    }
+    catch (...) {
+        return exception_pdu(response, (size > 0) ? request[0] : 0, EX_SLAVE_FAILURE);
+    }
+}
+
+
+inline size_t Server::dispatch(unsigned unit_id, const uint8_t* request, size_t size, uint8_t* response)
+{
+    try {
+        std::unique_lock<std::mutex> lock(access_mutex, std::defer_lock);
+        if (serialize_access) {
+            lock.lock();
+        }
+        return dispatch_pdu(unit_for(unit_id), request, size, response);
+    }
+    catch (...) {
+        return exception_pdu(response, (size > 0) ? request[0] : 0, EX_SLAVE_FAILURE);
+    }
+}
+
+
+inline bool Server::Session::feed(const uint8_t* data, size_t size, std::vector<uint8_t>& responses)
+{
+    while (size > 0) {
+        size_t taken = std::min(size, sizeof(connection.buffer) - connection.size);
+        std::memcpy(connection.buffer + connection.size, data, taken);
+        connection.size += taken;
+        data += taken;
+        size -= taken;
+        
+        // the output takes one response at a time, so there is always room for the frames handled here
+        size_t offset = 0, length;
+        while (connection.size - offset >= 7) {
+            if (! server.frame_length(connection.buffer + offset, length)) {
+                connection.size = 0;
+                return false;
+            }
+            if (connection.size - offset < length) {
+                break;
+            }
+            server.handle_single_request(connection, connection.buffer + offset, length);
+            responses.insert(responses.end(), connection.output, connection.output + connection.output_size);
+            connection.output_size = 0;
+            offset += length;
+        }
+        std::memmove(connection.buffer, connection.buffer + offset, connection.size - offset);
+        connection.size -= offset;
+    }
+    return true;
+}
+
+
+inline ServerStats Server::stats()
+{
+    ServerStats stats;
+    std::lock_guard<std::mutex> lock(loops_mutex);
+    for (const auto& loop: loops) {
+        const auto& counters = loop->counters;
+        for (unsigned i = 0; i < 256; i++) {
+            stats.requests_by_function[i] += counters.requests[i].load(std::memory_order_relaxed);
+            stats.exceptions_by_code[i] += counters.exceptions[i].load(std::memory_order_relaxed);
+        }
+        stats.bytes_in += counters.bytes_in.load(std::memory_order_relaxed);
+        stats.bytes_out += counters.bytes_out.load(std::memory_order_relaxed);
+        uint64_t accepted = counters.accepted.load(std::memory_order_relaxed);
+        uint64_t closed = counters.closed.load(std::memory_order_relaxed);
+        stats.connections_accepted += accepted;
+        stats.connections_active += (accepted > closed) ? accepted - closed : 0;
+        for (unsigned i = 0; i < ServerStats::LATENCY_BUCKETS; i++) {
+            stats.latency_histogram[i] += counters.latency[i].load(std::memory_order_relaxed);
+        }
+        stats.latency_max_ns = std::max(stats.latency_max_ns, counters.latency_max.load(std::memory_order_relaxed));
+    }
+    for (unsigned i = 0; i < 256; i++) {
+        stats.requests += stats.requests_by_function[i];
+        stats.exceptions += stats.exceptions_by_code[i];
+    }
+    stats.table_accesses = default_unit.chain.access_counts();
+    for (const auto& unit: routed_units) {
+        auto accesses = unit->chain.access_counts();
+        stats.table_accesses.insert(stats.table_accesses.end(), accesses.begin(), accesses.end());
+    }
+    return stats;
+}
+
+
+inline unsigned Server::DiagnosticTable::read_block(unsigned address, unsigned count, unsigned* values)
+{
+    if ((address < start) || (address - start >= SIZE)) {
+        return 0;
+    }
+    // Only the counters asked for are summed over the loops (no full stats() per read)
+    unsigned first = address - start;
+    unsigned n = std::min(count, SIZE - first);
+    auto wanted = [first, n](unsigned from, unsigned to) { return (first < to) && (first + n > from); };
+    bool by_function = wanted(0, 1) || wanted(16, 16 + 128);
+    bool by_code = wanted(1, 2) || wanted(10, 16);
+    bool latency = wanted(6, 9);
+    ServerStats stats;
+    {
+        std::lock_guard<std::mutex> lock(server->loops_mutex);
+        for (const auto& loop: server->loops) {
+            const auto& counters = loop->counters;
+            for (unsigned i = 0; i < 256; i++) {
+                if (by_function) {
+                    stats.requests_by_function[i] += counters.requests[i].load(std::memory_order_relaxed);
+                }
+                if (by_code) {
+                    stats.exceptions_by_code[i] += counters.exceptions[i].load(std::memory_order_relaxed);
+                }
+            }
+            stats.bytes_in += counters.bytes_in.load(std::memory_order_relaxed);
+            stats.bytes_out += counters.bytes_out.load(std::memory_order_relaxed);
+            uint64_t accepted = counters.accepted.load(std::memory_order_relaxed);
+            uint64_t closed = counters.closed.load(std::memory_order_relaxed);
+            stats.connections_accepted += accepted;
+            stats.connections_active += (accepted > closed) ? accepted - closed : 0;
+            for (unsigned i = 0; latency && (i < ServerStats::LATENCY_BUCKETS); i++) {
+                stats.latency_histogram[i] += counters.latency[i].load(std::memory_order_relaxed);
+            }
+            stats.latency_max_ns = std::max(stats.latency_max_ns, counters.latency_max.load(std::memory_order_relaxed));
+        }
+    }
+    for (unsigned i = 0; i < 256; i++) {
+        stats.requests += stats.requests_by_function[i];
+        stats.exceptions += stats.exceptions_by_code[i];
+    }
+    for (unsigned i = 0; i < n; i++) {
+        unsigned index = first + i;
+        uint64_t value = 0;
+        switch (index) {
+          case 0: value = stats.requests; break;
+          case 1: value = stats.exceptions; break;
+          case 2: value = stats.bytes_in; break;
+          case 3: value = stats.bytes_out; break;
+          case 4: value = stats.connections_active; break;
+          case 5: value = stats.connections_accepted; break;
+          case 6: value = stats.latency_percentile_ns(0.5); break;
+          case 7: value = stats.latency_percentile_ns(0.99); break;
+          case 8: value = stats.latency_percentile_ns(0.999); break;
+          case 9: value = stats.latency_max_ns; break;
+          case 16 + 128: value = server->default_unit.changes ? server->default_unit.changes->version() : 0; break;
+          default:
+            if (index < 16) {
+                value = stats.exceptions_by_code[index - 9];  // codes 1 to 6
+            }
+            else {
+                value = stats.requests_by_function[index - 16];
+            }
+        }
+        values[i] = static_cast<unsigned>(std::min<uint64_t>(value, std::numeric_limits<uint32_t>::max()));
+    }
+    return n;
+}
+    
+
+inline int Server::run(int argc, char** argv)
+{
+    unsigned port = 502;
+    if (argc >= 2) {
+        port = std::stoi(argv[1]);
+    }
+
+    try {
+        serve(port);
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+inline void Server::serve(unsigned port)
+{
+    // With several threads, every loop gets its own SO_REUSEPORT listener on Linux;
+    // elsewhere the loops share one listener and race for the accept()
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    bool reuse_port = (threads > 1);
+#else
+    bool reuse_port = false;
+#endif
+    if (listen_addresses.empty()) {
+        listen_addresses.push_back(ListenAddress{"", port, ""});
+    }
+    {
+        std::lock_guard<std::mutex> lock(loops_mutex);
+        if (! loops.empty()) {
+            throw std::runtime_error("serve() called twice");
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            loops.push_back(std::make_unique<EventLoop>());
+            for (size_t k = 0; k < listen_addresses.size(); k++) {
+                // a Unix-domain socket is always shared
+                bool own = (i == 0) || (reuse_port && listen_addresses[k].path.empty());
+                loops[i]->listen_fds.push_back(own ? open_listener(listen_addresses[k], reuse_port) : loops[0]->listen_fds[k]);
+            }
+        }
+    }
+    
+    // a single register thread serializes the table accesses by itself
+    serialize_access = ! register_thread && (threads > 1) && (concurrency == Concurrency::Serialized);
+    bool lock_tables = ! register_thread && (threads > 1) && (concurrency == Concurrency::PerTable);
+    default_unit.chain.set_table_locking(lock_tables);
+    for (auto& unit: routed_units) {
+        unit->chain.set_table_locking(lock_tables);
+    }
+    if (register_thread) {
+        if (event_backend == EventBackend::IoUring) {
+            throw std::runtime_error("the register thread is not available with the io_uring engine");
+        }
+        jobs = std::make_unique<BoundedQueue<Connection*, 1024>>();
+        jobs_wakeup = std::make_unique<Wakeup>();
+        for (auto& loop: loops) {
+            loop->completions = std::make_unique<BoundedQueue<Connection*, 1024>>();
+            loop->wakeup = std::make_unique<Wakeup>();
+            loop->waiting.reserve(64);
+            loop->retrying.reserve(64);
+        }
+    }
+    else if (event_backend != EventBackend::IoUring) {
+        for (auto& loop: loops) {
+            loop->resumed = std::make_unique<BoundedQueue<Connection*, 1024>>();
+            loop->wakeup = std::make_unique<Wakeup>();
+            loop->requests_per_turn = requests_per_turn;  // the register thread takes the frames by the job
+        }
+    }
+    loops[0]->runs_timers = ! register_thread;
+    if (realtime) {
+        prepare_realtime_memory();
+    }
+    
+    char threading[64] = "";
+    if (threads > 1) {
+        std::snprintf(threading, sizeof(threading), " with %u threads", threads);
+    }
+    std::string listening;
+    for (const auto& listen_address: listen_addresses) {
+        listening += (listening.empty() ? "" : ", ") + describe(listen_address);
+    }
+    log(LogLevel::Info, "Modbus TCP server %s listening on %s%s%s",
+        (default_unit.data_width == DataWidth::W32 ? "(32bit mode)" : "(16bit mode)"), listening.c_str(), threading, (register_thread ? " (register thread)" : "")
+    );
+
+    if (register_thread) {
+        std::thread([this]() {
+            try {
+                enter_realtime_thread(threads);
+                run_register_thread();
+            }
+            catch (const std::exception& e) {
+                std::cerr << "ERROR: " << e.what() << std::endl;
+                std::exit(-1);
+            }
+        }).detach();
+    }
+
+    for (unsigned i = 1; i < threads; i++) {
+        EventLoop* loop = loops[i].get();
+        std::thread([this, loop, i]() {
+            try {
+                enter_realtime_thread(i);
+                run_loop(*loop);
+            }
+            catch (const std::exception& e) {
+                std::cerr << "ERROR: " << e.what() << std::endl;
+                std::exit(-1);
+            }
+        }).detach();
+    }
+    enter_realtime_thread(0);
+    run_loop(*loops[0]);
+}
+
+
+inline void Server::prepare_realtime_memory()
+{
+    // Nothing on the way of a request is to allocate or to fault in a page: each loop gets a fixed pool
+    // of connections (any loop may take all of them), a slot for each fd, and everything is locked.
+    // Closed connections may keep their slot a little longer (register thread, deferred read, io_uring
+    // completions), so the limit of set_max_connections() gets as many again.
+    unsigned connections = (max_connections > 0) ? 2 * max_connections : realtime_profile.connections;
+#if defined(__GLIBC__)
+    ::mallopt(M_TRIM_THRESHOLD, -1);  // freed memory stays in the heap
+    ::mallopt(M_MMAP_MAX, 0);         // large blocks too, instead of a fresh mapping each time
+#endif
+    size_t fds = 1024;
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        fds = std::min<size_t>(limit.rlim_cur, 65536);  // beyond that, the fd slots grow on demand
+    }
+    for (auto& loop: loops) {
+        loop->pool.reset(new Connection[connections]);
+        loop->free_slots.reserve(connections);
+        for (unsigned i = connections; i > 0; i--) {
+            loop->free_slots.push_back(&loop->pool[i - 1]);
+        }
+        loop->connections.resize(std::max(fds, loop->connections.size()), nullptr);
+        loop->waiting.reserve(connections);
+        loop->retrying.reserve(connections);
+    }
+    if (realtime_profile.lock_memory) {
+        if (::mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            throw std::runtime_error("mlockall() failed (needs CAP_IPC_LOCK or a higher RLIMIT_MEMLOCK)");
+        }
+    }
+}
+
+
+inline void Server::enter_realtime_thread(unsigned index)
+{
+    // Called by each event-loop thread ("index" = loop number) and by the register thread ("index" = threads)
+    if (! realtime) {
+        return;
+    }
+#if defined(__linux__)
+    if (index < realtime_profile.cpus.size()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(realtime_profile.cpus[index], &cpus);
+        if (::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus) != 0) {
+            throw std::runtime_error("pthread_setaffinity_np() failed for CPU " + std::to_string(realtime_profile.cpus[index]));
+        }
+    }
+#else
+    if (index < realtime_profile.cpus.size()) {
+        log(LogLevel::Warning, "CPU affinity is not supported on this platform");
+    }
+#endif
+    if (realtime_profile.priority > 0) {
+        sched_param param{};
+        param.sched_priority = realtime_profile.priority;
+        if (::pthread_setschedparam(::pthread_self(), SCHED_FIFO, &param) != 0) {
+            throw std::runtime_error("pthread_setschedparam(SCHED_FIFO) failed (needs CAP_SYS_NICE or RLIMIT_RTPRIO)");
+        }
+    }
+}
+
+
+inline int Server::open_listener(const ListenAddress& listen_address, bool reuse_port)
+{
+    sockaddr_storage addr{};
+    socklen_t addr_size;
+    if (! listen_address.path.empty()) {
+        auto* un = reinterpret_cast<sockaddr_un*>(&addr);
+        un->sun_family = AF_UNIX;
+        std::strncpy(un->sun_path, listen_address.path.c_str(), sizeof(un->sun_path) - 1);
+        addr_size = sizeof(sockaddr_un);
+        // a socket left by a previous run; anything else at the path is kept, and bind() fails
+        struct stat st;
+        if ((::lstat(un->sun_path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+            ::unlink(un->sun_path);
+        }
+    }
+    else {
+        auto* in = reinterpret_cast<sockaddr_in*>(&addr);
+        auto* in6 = reinterpret_cast<sockaddr_in6*>(&addr);
+        uint16_t port = htons(static_cast<uint16_t>(listen_address.port));
+        if (listen_address.address.empty()) {
+            in->sin_family = AF_INET;
+            in->sin_addr.s_addr = htonl(INADDR_ANY);
+            in->sin_port = port;
+            addr_size = sizeof(sockaddr_in);
+        }
+        else if (::inet_pton(AF_INET, listen_address.address.c_str(), &in->sin_addr) == 1) {
+            in->sin_family = AF_INET;
+            in->sin_port = port;
+            addr_size = sizeof(sockaddr_in);
+        }
+        else if (::inet_pton(AF_INET6, listen_address.address.c_str(), &in6->sin6_addr) == 1) {
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = port;
+            addr_size = sizeof(sockaddr_in6);
+        }
+        else {
+            throw std::runtime_error("invalid listen address: " + listen_address.address);
+        }
+    }
+    
+    int listen_fd = ::socket(addr.ss_family, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        throw std::runtime_error("socket() failed for " + describe(listen_address));
+    }
+    int yes = 1, no = 0;
+    if (addr.ss_family != AF_UNIX) {
+        ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+        if (reuse_port) {
+            ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        }
+#endif
+    }
+    if (addr.ss_family == AF_INET6) {
+        ::setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));  // dual-stack, which is not the default everywhere
+    }
+
+    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), addr_size) < 0) {
+        ::close(listen_fd);
+        if (addr.ss_family == AF_UNIX) {
+            throw std::runtime_error("bind() failed for " + describe(listen_address));
+        }
+        throw std::runtime_error("bind() failed for " + describe(listen_address) + " (note that port 502 needs root)");
+    }
+    if (::listen(listen_fd, listen_backlog) < 0) {
+        ::close(listen_fd);
+        throw std::runtime_error("listen() failed");
+    }
+    set_nonblocking(listen_fd);
+    
+    return listen_fd;
+}
+
+
+inline std::string Server::describe(const ListenAddress& listen_address)
+{
+    if (! listen_address.path.empty()) {
+        return listen_address.path;
+    }
+    if (listen_address.address.empty()) {
+        return "port " + std::to_string(listen_address.port);
+    }
+    bool ipv6 = (listen_address.address.find(':') != std::string::npos);
+    return (ipv6 ? "[" + listen_address.address + "]" : listen_address.address) + ":" + std::to_string(listen_address.port);
+}
+
+
+inline void Server::describe_peer(const sockaddr_storage& peer, char* text, size_t size)
+{
+    char ipbuf[INET6_ADDRSTRLEN];
+    if (peer.ss_family == AF_INET) {
+        const auto& in = reinterpret_cast<const sockaddr_in&>(peer);
+        ::inet_ntop(AF_INET, &in.sin_addr, ipbuf, sizeof(ipbuf));
+        std::snprintf(text, size, "%s:%u", ipbuf, unsigned(ntohs(in.sin_port)));
+    }
+    else if (peer.ss_family == AF_INET6) {
+        const auto& in6 = reinterpret_cast<const sockaddr_in6&>(peer);
+        ::inet_ntop(AF_INET6, &in6.sin6_addr, ipbuf, sizeof(ipbuf));
+        std::snprintf(text, size, "[%s]:%u", ipbuf, unsigned(ntohs(in6.sin6_port)));
+    }
+    else {
+        std::snprintf(text, size, "local");
+    }
+}
+
+
+inline void Server::run_loop(EventLoop& loop)
+{
+#ifdef KOMOB_USE_IO_URING
+    if (event_backend == EventBackend::IoUring) {
+        serve_io_uring(loop);
+        return;
+    }
+#endif
+    loop.poller = EventPoller::create(event_backend);
+    for (int listen_fd: loop.listen_fds) {
+        loop.poller->add(listen_fd);
+    }
+    if (loop.wakeup) {
+        loop.poller->add(loop.wakeup->fd());
+    }
+    std::vector<EventPoller::Event> events;
+
+    while (true) {
+        int n = loop.poller->wait(wait_timeout_ms(loop), events);
+        if (loop.wakeup) {
+            loop.wakeup->awake();
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log(LogLevel::Error, "poll() failed: continue processing");
+            continue;
+        }
+
+        // only the ready connections are visited
+        bool accept_pending = false;
+        for (const auto& event: events) {
+            if (std::find(loop.listen_fds.begin(), loop.listen_fds.end(), event.fd) != loop.listen_fds.end()) {
+                accept_pending = true;  // after the others, so that a reused fd does not get a stale event
+                continue;
+            }
+            if (loop.wakeup && (event.fd == loop.wakeup->fd())) {
+                loop.wakeup->clear();
+                continue;  // completions are taken below
+            }
+            Connection* found = find_connection(loop, event.fd);
+            if (! found) {
+                continue;  // already closed in this round
+            }
+            Connection& connection = *found;
+
+            bool close_this = event.error;
+            if (! close_this && event.writable && ! connection.busy) {
+                // the queued responses, then the requests held back by them
+                close_this = ! flush(connection) || ! respond(connection);
+            }
+            if (! close_this && event.readable) {
+                try {
+                    if (! receive(connection)) {
+                        close_this = true; // close/error -> close
+                    }
+                } catch (...) {
+                    close_this = true;
+                }
+            }
+            if (close_this) {
+                close_connection(connection);
+            }
+        }
+
+        // another turn for the connections with frames left, once each, in the order they were left
+        if (loop.ready_head) {
+            Connection* last = loop.ready_tail;
+            bool done = false;
+            while (! done && loop.ready_head) {
+                Connection& connection = *loop.ready_head;
+                done = (&connection == last);
+                unlink_ready(connection);
+                if (! respond(connection)) {
+                    close_connection(connection);
+                }
+            }
+        }
+        
+        // announced before the queues are looked at, so that a completion pushed after that wakes the wait below
+        if (loop.wakeup) {
+            loop.wakeup->prepare();
+        }
+        if (loop.resumed) {
+            Connection* connection;
+            while (loop.resumed->pop(connection)) {
+                resume(*connection);
+            }
+        }
+        
+        // responses from the register thread, then the jobs that did not fit in the queue
+        if (loop.completions) {
+            Connection* completed;
+            while (loop.completions->pop(completed)) {
+                complete_job(*completed);
+            }
+            // the ones that still do not fit go back to "waiting", in the same order
+            loop.retrying.swap(loop.waiting);
+            for (Connection* connection: loop.retrying) {
+                connection->busy = false;
+                if (connection->close_pending) {
+                    close_connection(*connection);
+                }
+                else {
+                    submit_job(*connection);
+                }
+            }
+            loop.retrying.clear();
+        }
+
+        if (loop.runs_timers) {
+            run_timers();
+        }
+        close_expired(loop);
+
+        // new connection
+        if (accept_pending) {
+            for (int listen_fd: loop.listen_fds) {
+                accept_all(loop, listen_fd);
+            }
+        }
+    }
+}
+
+
+inline void Server::accept_all(EventLoop& loop, int listen_fd)
+{
+    while (true) {
+        sockaddr_storage client{};
+        socklen_t client_size = sizeof(client);
+        int fd = ::accept(listen_fd, reinterpret_cast<sockaddr*>(&client), &client_size);
+        if (fd < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            log(LogLevel::Error, "accept() failed");
+            break;
+        }
+
+        if (! admit(loop)) {
+            ::close(fd);
+            continue;
+        }
+        set_nonblocking(fd);
+        set_client_options(fd, client.ss_family != AF_UNIX);
+
+        if (logging(LogLevel::Info)) {
+            char peer[80];
+            describe_peer(client, peer, sizeof(peer));
+            log(LogLevel::Info, "Client connected: %s", peer);
+        }
+
+        try {
+            loop.poller->add(fd);
+        }
+        catch (const std::exception& e) {
+            log(LogLevel::Error, "%s", e.what());
+            connection_count--;
+            ::close(fd);
+            continue;
+        }
+        Connection& connection = add_connection(loop, fd);
+        connection.admitted = true;
+        attach_rate_limit(connection, client);
+        if (capture) {
+            connection.capture_stream = capture->open_stream();
+        }
+        touch(connection);
+        count(loop.counters.accepted);
+    }
+}
+
+
+inline void Server::close_connection(Connection& connection)
+{
+    int fd = connection.fd;
+    EventLoop& loop = *connection.loop;
+    release(connection);
+    if (! connection.paused) {
+        loop.poller->remove(fd);
+        connection.paused = true;
+    }
+    if (connection.busy || connection.deferring) {
+        connection.close_pending = true;  // closed when the register thread or the table is done with it
+        return;
+    }
+    remove_connection(loop, fd);
+    ::close(fd);
+    count(loop.counters.closed);
+    log(LogLevel::Info, "Client disconnected.");
+}
+
+
+inline bool Server::admit(EventLoop& loop)
+{
+    // Takes a slot for a new connection, evicting the least recently active one of this loop if so configured
+    if (max_connections == 0) {
+        connection_count++;
+    }
+    else while (true) {
+        unsigned current = connection_count.load();
+        if (current < max_connections) {
+            if (connection_count.compare_exchange_weak(current, current + 1)) {
+                break;
+            }
+            continue;
+        }
+        Connection* oldest = loop.idle_head;
+        if ((connection_policy != ConnectionPolicy::EvictOldestIdle) || ! oldest) {
+            log(LogLevel::Warning, "Connection rejected: too many connections");
+            return false;
+        }
+        log(LogLevel::Warning, "Connection evicted: too many connections");
+        close_any(*oldest);
+    }
+    // the pool of set_realtime() is left to closing connections only; evicting more would not free a slot now
+    if (loop.pool && loop.free_slots.empty()) {
+        log(LogLevel::Warning, "Connection rejected: no free connection slot");
+        connection_count--;
+        return false;
+    }
+    return true;
+}
+
+
+inline Server::Connection& Server::add_connection(EventLoop& loop, int fd)
+{
+    // A free slot of the pool, taken by admit(), or a new connection without set_realtime()
+    Connection* connection;
+    if (loop.pool) {
+        connection = loop.free_slots.back();
+        loop.free_slots.pop_back();
+    }
+    else {
+        connection = new Connection();
+    }
+    if (size_t(fd) >= loop.connections.size()) {
+        loop.connections.resize(fd + 1, nullptr);
+    }
+    loop.connections[fd] = connection;
+    connection->fd = fd;
+    connection->loop = &loop;
+    connection->deferred.connection = connection;
+    return *connection;
+}
+
+
+inline void Server::remove_connection(EventLoop& loop, int fd)
+{
+    Connection* connection = loop.connections[fd];
+    loop.connections[fd] = nullptr;
+    if (loop.pool) {
+        connection->~Connection();  // back to the state of a fresh slot
+        new (connection) Connection();
+        loop.free_slots.push_back(connection);
+    }
+    else {
+        delete connection;
+    }
+}
+
+
+inline void Server::release(Connection& connection)
+{
+    // the connection is closing: no more timeouts, and its slot is free
+    unlink_incomplete(connection);
+    unlink_idle(connection);
+    unlink_ready(connection);
+    if (connection.capture_stream) {
+        capture->close_stream(connection.capture_stream);
+        connection.capture_stream = 0;
+    }
+    if (connection.admitted) {
+        connection.admitted = false;
+        connection_count--;
+    }
+}
+
+
+inline void Server::attach_rate_limit(Connection& connection, const sockaddr_storage& peer)
+{
+    if (rate_limit <= 0) {
+        return;
+    }
+    auto fresh = [this]() {
+        auto bucket = std::make_shared<RateBucket>();
+        bucket->tokens = rate_burst;
+        bucket->last = Clock::now();
+        return bucket;
+    };
+    if (rate_scope == RateLimitScope::Connection) {
+        connection.rate_bucket = fresh();
+        return;
+    }
+    
+    // the host part of the address; an IPv4-mapped IPv6 address is the IPv4 one
+    std::string key = "local";
+    if (peer.ss_family == AF_INET) {
+        const auto& in = reinterpret_cast<const sockaddr_in&>(peer);
+        key.assign(reinterpret_cast<const char*>(&in.sin_addr), 4);
+    }
+    else if (peer.ss_family == AF_INET6) {
+        const auto& in6 = reinterpret_cast<const sockaddr_in6&>(peer);
+        const char* bytes = reinterpret_cast<const char*>(&in6.sin6_addr);
+        key = IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr) ? std::string(bytes + 12, 4) : std::string(bytes, 16);
+    }
+    std::lock_guard<std::mutex> lock(rate_mutex);
+    auto& slot = rate_buckets[key];
+    connection.rate_bucket = slot.lock();
+    if (! connection.rate_bucket) {
+        connection.rate_bucket = fresh();
+        slot = connection.rate_bucket;
+    }
+    if (rate_buckets.size() > rate_sweep_at) {
+        // the addresses without connections left
+        for (auto i = rate_buckets.begin(); i != rate_buckets.end(); ) {
+            i = i->second.expired() ? rate_buckets.erase(i) : std::next(i);
+        }
+        rate_sweep_at = 2 * rate_buckets.size() + 64;
+    }
+}
+
+
+inline bool Server::take_token(RateBucket& bucket)
+{
+    // refilled at "rate_limit" tokens per second, up to "rate_burst"; one per request
+    std::lock_guard<std::mutex> lock(bucket.mutex);
+    auto now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - bucket.last).count();
+    bucket.last = now;
+    bucket.tokens = std::min(rate_burst, bucket.tokens + elapsed * rate_limit);
+    if (bucket.tokens < 1) {
+        return false;
+    }
+    bucket.tokens -= 1;
+    return true;
+}
+
+
+inline void Server::close_any(Connection& connection)
+{
+#ifdef KOMOB_USE_IO_URING
+    if (event_backend == EventBackend::IoUring) {
+        close_io_uring(connection);
+        return;
+    }
+#endif
+    close_connection(connection);
+}
+
+
+inline int Server::wait_timeout_ms(const EventLoop& loop)
+{
+    // no longer than the earliest incomplete-frame deadline or idle timeout
+    if (loop.ready_head) {
+        return 0;  // frames left for the next turn
+    }
+    Clock::time_point deadline = Clock::time_point::max();
+    if (loop.incomplete_head) {
+        deadline = loop.incomplete_head->deadline;
+    }
+    if ((idle_timeout_ms > 0) && loop.idle_head) {
+        deadline = std::min(deadline, loop.idle_head->last_active + std::chrono::milliseconds(idle_timeout_ms));
+    }
+    if (loop.runs_timers && ! timers.empty()) {
+        deadline = std::min(deadline, timers.front().next);
+    }
+    return timeout_ms_until(deadline);
+}
+
+
+inline int Server::timeout_ms_until(Clock::time_point deadline)
+{
+    // -1 (infinite) for time_point::max()
+    if (deadline == Clock::time_point::max()) {
+        return -1;
+    }
+    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now()).count();
+    return static_cast<int>(std::max<decltype(remaining)>(remaining, 0));
+}
+
+
+inline void Server::run_timers()
+{
+    // the due callbacks, in deadline order
+    if (timers.empty()) {
+        return;
+    }
+    auto later = [](const Timer& a, const Timer& b) { return a.next > b.next; };
+    auto now = Clock::now();
+    while (timers.front().next <= now) {
+        std::pop_heap(timers.begin(), timers.end(), later);
+        Timer& timer = timers.back();
+        try {
+            std::unique_lock<std::mutex> lock(access_mutex, std::defer_lock);
+            if (serialize_access) {
+                lock.lock();
+            }
+            timer.callback();
+        }
+        catch (const std::exception& e) {
+            log(LogLevel::Error, "ERROR: timer callback: %s", e.what());
+        }
+        // fixed rate; periods missed by an overrun are skipped, not caught up with
+        timer.next += timer.interval;
+        auto after = Clock::now();
+        if (timer.next <= after) {
+            timer.next += ((after - timer.next) / timer.interval + 1) * timer.interval;
+        }
+        std::push_heap(timers.begin(), timers.end(), later);
+    }
+}
+
+
+inline void Server::close_expired(EventLoop& loop)
+{
+    // incomplete frames timed out -> close (the list is ordered by deadline)
+    auto now = Clock::now();
+    while (loop.incomplete_head && (loop.incomplete_head->deadline <= now)) {
+        log(LogLevel::Debug, "Timeout during a request");
+        close_any(*loop.incomplete_head);
+    }
+    
+    // nothing received for too long -> close (the list is ordered by activity)
+    if (idle_timeout_ms > 0) {
+        auto limit = now - std::chrono::milliseconds(idle_timeout_ms);
+        while (loop.idle_head && (loop.idle_head->last_active <= limit)) {
+            log(LogLevel::Info, "Idle connection closed");
+            close_any(*loop.idle_head);
+        }
+    }
+}
+
+
+#ifdef KOMOB_USE_IO_URING
+inline void Server::serve_io_uring(EventLoop& loop)
+{
+    // Completion-based: multishot accept, multishot recv into provided buffers,
+    // and the sends of a round submitted together with the next wait
+    IoUring ring(256, 4096);
+    ring.setup_buffers(RING_BUFFERS, 2048);
+    
+    auto arm_accept = [&](int listen_fd) {
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = user_data(OP_ACCEPT, listen_fd, 0);
+    };
+    auto arm_recv = [&](Connection& connection) {
+        io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = connection.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = user_data(OP_RECV, connection.fd, connection.id);
+        connection.receiving = true;
+        connection.receive_paused = false;
+        connection.receive_starved = false;
+    };
+    // a recv is armed again only when the parked buffers have been taken, and none is missing in the ring
+    auto resume_recv = [&](Connection& connection) {
+        if (! connection.receiving && ! connection.closing && ! connection.receive_starved && (connection.parked_count == 0)) {
+            arm_recv(connection);
+        }
+    };
+    std::vector<std::pair<int, uint32_t>> starved;  // connections waiting for buffers: fd, id
+    uint64_t recycled = ring.recycled();
+    for (int listen_fd: loop.listen_fds) {
+        arm_accept(listen_fd);
+    }
+    
+    uint32_t last_id = 0;
+    while (true) {
+        int result = ring.submit_and_wait(wait_timeout_ms(loop));
+        if ((result < 0) && (result != -ETIME) && (result != -EINTR)) {
+            log(LogLevel::Error, "io_uring_enter() failed: continue processing");
+        }
+        
+        ring.for_each_completion([&](const io_uring_cqe& cqe) {
+            uint64_t op = cqe.user_data & 0xff;
+            int fd = static_cast<int>((cqe.user_data >> 8) & 0xffffff);
+            uint32_t id = static_cast<uint32_t>(cqe.user_data >> 32);
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+            
+            if (op == OP_CANCEL) {
+                return;  // the recv ends with its own completion
+            }
+            if (op == OP_ACCEPT) {
+                if ((cqe.res >= 0) && ! admit(loop)) {
+                    ::close(cqe.res);
+                }
+                else if (cqe.res >= 0) {
+                    int client_fd = cqe.res;
+                    sockaddr_storage client{};
+                    socklen_t client_size = sizeof(client);
+                    ::getpeername(client_fd, reinterpret_cast<sockaddr*>(&client), &client_size);
+                    set_client_options(client_fd, client.ss_family != AF_UNIX);
+                    if (logging(LogLevel::Info)) {
+                        char peer[80];
+                        describe_peer(client, peer, sizeof(peer));
+                        log(LogLevel::Info, "Client connected: %s", peer);
+                    }
+                    count(loop.counters.accepted);
+                    
+                    Connection& connection = add_connection(loop, client_fd);
+                    connection.id = ++last_id;
+                    connection.admitted = true;
+                    attach_rate_limit(connection, client);
+                    if (capture) {
+                        connection.capture_stream = capture->open_stream();
+                    }
+                    touch(connection);
+                    arm_recv(connection);
+                }
+                else {
+                    log(LogLevel::Error, "accept() failed");
+                }
+                if (! more) {
+                    arm_accept(fd);
+                }
+                return;
+            }
+            
+            Connection* found = find_connection(loop, fd);
+            if (! found || (found->id != id)) {
+                return;  // stale
+            }
+            Connection& connection = *found;
+            
+            if (op == OP_RECV) {
+                connection.receiving = more;
+                if (cqe.flags & IORING_CQE_F_BUFFER) {
+                    unsigned buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    if ((cqe.res > 0) && ! connection.closing) {
+                        // kept in order behind "buffer", which is drained as the responses go out
+                        if (connection.capture_stream) {
+                            capture->record(connection.capture_stream, ring.buffer(buffer_id), static_cast<size_t>(cqe.res));
+                        }
+                        connection.parked[connection.parked_count++] = {static_cast<uint16_t>(buffer_id), static_cast<uint16_t>(cqe.res)};
+                        count(loop.counters.bytes_in, static_cast<uint64_t>(cqe.res));
+                        touch(connection);
+                    }
+                    else {
+                        ring.recycle_buffer(buffer_id);
+                    }
+                }
+                if (connection.closing) {
+                    close_io_uring(connection);
+                    return;
+                }
+                if ((cqe.res == 0) || ((cqe.res < 0) && (cqe.res != -ENOBUFS) && (cqe.res != -ECANCELED))) {
+                    close_io_uring(connection);  // closed or error
+                    return;
+                }
+                if ((cqe.res > 0) && ! pump_io_uring(ring, connection)) {
+                    close_io_uring(connection);
+                    return;
+                }
+                if (connection.receiving && ! connection.receive_paused && (connection.parked_count >= PARKED_LIMIT)) {
+                    // far ahead of its responses: no more reading, as the poller loops do, until the buffers are taken
+                    io_uring_sqe* sqe = ring.get_sqe();
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = user_data(OP_RECV, connection.fd, connection.id);
+                    sqe->user_data = user_data(OP_CANCEL, connection.fd, connection.id);
+                    connection.receive_paused = true;
+                }
+                if (! more && (cqe.res == -ENOBUFS)) {
+                    connection.receive_starved = true;  // arming again now would fail at once
+                    starved.push_back({connection.fd, connection.id});
+                }
+                else if (! more) {
+                    resume_recv(connection);  // cancelled, or the kernel ended the multishot
+                }
+            }
+            else if (op == OP_SEND) {
+                connection.sending = false;
+                if (connection.closing || (cqe.res <= 0)) {
+                    close_io_uring(connection);
+                    return;
+                }
+                connection.sent += static_cast<size_t>(cqe.res);
+                count(loop.counters.bytes_out, static_cast<uint64_t>(cqe.res));
+                if (connection.sent < connection.in_flight_size) {
+                    submit_send(ring, connection);  // the rest of a partial send
+                }
+                else if (! pump_io_uring(ring, connection)) {
+                    close_io_uring(connection);
+                }
+                else {
+                    resume_recv(connection);
+                }
+            }
+        });
+        
+        if (! starved.empty() && (ring.recycled() != recycled)) {
+            for (const auto& waiting: starved) {
+                Connection* found = find_connection(loop, waiting.first);
+                if (found && (found->id == waiting.second)) {
+                    found->receive_starved = false;
+                    resume_recv(*found);
+                }
+            }
+            starved.clear();
+        }
+        recycled = ring.recycled();
+
+        if (loop.runs_timers) {
+            run_timers();
+        }
+        close_expired(loop);
+    }
+}
+
+
+inline bool Server::pump_io_uring(IoUring& ring, Connection& connection)
+{
+    // Moves data along: parked buffers -> frames -> responses -> send
+    while (true) {
+        unsigned taken = 0;
+        while ((taken < connection.parked_count) && (connection.size + connection.parked[taken].length <= sizeof(connection.buffer))) {
+            auto& parked = connection.parked[taken++];
+            std::memcpy(connection.buffer + connection.size, ring.buffer(parked.id), parked.length);
+            connection.size += parked.length;
+            ring.recycle_buffer(parked.id);
+        }
+        if (taken > 0) {
+            std::copy(connection.parked + taken, connection.parked + connection.parked_count, connection.parked);
+            connection.parked_count -= taken;
+        }
+        
+        try {
+            if (! process_frames(connection)) {
+                return false;
+            }
+        }
+        catch (...) {
+            return false;
+        }
+        
+        if (connection.sending || (connection.output_size == 0)) {
+            return true;  // continued on the send completion
+        }
+        submit_send(ring, connection);
+    }
+}
+
+
+inline void Server::submit_send(IoUring& ring, Connection& connection)
+{
+    if (connection.sent >= connection.in_flight_size) {
+        std::memcpy(connection.in_flight, connection.output, connection.output_size);
+        connection.in_flight_size = connection.output_size;
+        connection.output_size = 0;
+        connection.sent = 0;
+    }
+    io_uring_sqe* sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connection.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(connection.in_flight + connection.sent);
+    sqe->len = static_cast<uint32_t>(connection.in_flight_size - connection.sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(OP_SEND, connection.fd, connection.id);
+    connection.sending = true;
+}
+
+
+inline void Server::close_io_uring(Connection& connection)
+{
+    // The connection is released when the kernel no longer refers to its buffers
+    release(connection);
+    if (! connection.closing) {
+        connection.closing = true;
+        ::shutdown(connection.fd, SHUT_RDWR);
+    }
+    if (connection.receiving || connection.sending) {
+        return;
+    }
+    int fd = connection.fd;
+    EventLoop& loop = *connection.loop;
+    remove_connection(loop, fd);
+    ::close(fd);
+    count(loop.counters.closed);
+    log(LogLevel::Info, "Client disconnected.");
+}
+#endif
+
+
+inline void Server::set_nonblocking(int fd)
+{
+    int flags = ::fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+inline void Server::set_keepalive(int fd, int idle, int interval, int count)
+{
+    int yes = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,  &idle,  sizeof(idle));
+    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT,   &count,   sizeof(count));
+}
+
+
+inline void Server::set_client_options(int fd, bool tcp)
+{
+    if (tcp) {
+        set_keepalive(fd, keepalive_idle, keepalive_interval, keepalive_count);
+    }
+    if (! realtime || ! tcp) {
+        return;
+    }
+    int yes = 1;
+    if (realtime_profile.tcp_nodelay) {
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+#if defined(TCP_QUICKACK)
+    if (realtime_profile.tcp_quickack) {
+        ::setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes));
+    }
+#endif
+#if defined(SO_BUSY_POLL)
+    if ((realtime_profile.busy_poll_us > 0) &&
+        (::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &realtime_profile.busy_poll_us, sizeof(realtime_profile.busy_poll_us)) < 0)) {
+        log(LogLevel::Warning, "SO_BUSY_POLL not set (needs CAP_NET_ADMIN above net.core.busy_read)");
+    }
+#endif
+}
+
+
+inline bool Server::receive(Connection& connection)
+{
+    if (connection.busy && (connection.size == sizeof(connection.buffer))) {
+        // no more room while the register thread works on the frames: stop reading until it is done
+        connection.loop->poller->remove(connection.fd);
+        connection.paused = true;
+        return true;
+    }
+    if (connection.size == sizeof(connection.buffer)) {
+        // held back by the unsent responses: no reading until they are out
+        update_interest(connection);
+        return true;
+    }
+    
+    // Non-blocking: takes whatever is available and continues from there on the next POLLIN
+    ssize_t recv_size;
+    do {
+        recv_size = ::recv(connection.fd, connection.buffer + connection.size, sizeof(connection.buffer) - connection.size, 0);
+    } while ((recv_size < 0) && (errno == EINTR));
+    if (recv_size == 0) {
+        return false;          // connection closed
+    }
+    if (recv_size < 0) {
+        return (errno == EAGAIN) || (errno == EWOULDBLOCK);  // nothing arrived yet
+    }
+    if (connection.capture_stream) {
+        capture->record(connection.capture_stream, connection.buffer + connection.size, static_cast<size_t>(recv_size));
+    }
+    connection.size += static_cast<size_t>(recv_size);
+    count(connection.loop->counters.bytes_in, static_cast<uint64_t>(recv_size));
+#if defined(TCP_QUICKACK)
+    if (realtime && realtime_profile.tcp_quickack) {
+        int yes = 1;  // the kernel leaves the quick-ack mode by itself
+        ::setsockopt(connection.fd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes));
+    }
+#endif
+    touch(connection);
+    if (connection.busy) {
+        return true;  // appended after the frames of the job; taken when the job completes
+    }
+    
+    return respond(connection);
+}
+
+
+inline bool Server::respond(Connection& connection)
+{
+    // Responses are sent as far as the socket takes them; more frames are processed if the output was full
+    while (true) {
+        if (! process_frames(connection)) {
+            return false;
+        }
+        if (connection.busy) {
+            return true;
+        }
+        if (connection.output_size == 0) {
+            break;
+        }
+        if (! flush(connection)) {
+            return false;
+        }
+        if (connection.output_size > 0) {
+            break;  // the rest on POLLOUT
+        }
+        if (is_ready(connection)) {
+            break;  // the other connections first
+        }
+    }
+    update_interest(connection);
+    
+    return true;
+}
+
+
+inline bool Server::flush(Connection& connection)
+{
+    // Never blocks: a slow client keeps its responses queued in the output, and the others are served meanwhile
+    size_t sent = 0;
+    while (sent < connection.output_size) {
+        ssize_t sent_size = ::send(connection.fd, connection.output + sent, connection.output_size - sent, MSG_NOSIGNAL);
+        if (sent_size < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (sent_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;  // socket buffer full
+        }
+        else if (sent_size <= 0) {
+            return false;
+        }
+        sent += static_cast<size_t>(sent_size);
     }
-
-    try {
-        serve(port);
-    } catch (const std::exception& e) {
-        std::cerr << "ERROR: " << e.what() << std::endl;
-        return -1;
+    if (sent > 0) {
+        count(connection.loop->counters.bytes_out, sent);
+        std::memmove(connection.output, connection.output + sent, connection.output_size - sent);
+        connection.output_size -= sent;
     }
     
-    return 0;
+    return true;
 }
 
 
-inline void Server::serve(unsigned port)
+inline void Server::update_interest(Connection& connection)
 {
-    int listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        throw std::runtime_error("socket() failed");
+    // POLLOUT while responses are queued; no POLLIN while no more requests can be taken
+    if (connection.paused) {
+        return;  // re-added when the register thread is done
     }
-    int yes = 1;
-    ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    bool reading = (connection.output_size + MAX_RESPONSE_SIZE <= output_high_water) && (connection.size < sizeof(connection.buffer));
+    bool writing = (connection.output_size > 0);
+    if ((reading != connection.reading) || (writing != connection.writing)) {
+        connection.loop->poller->modify(connection.fd, reading, writing);
+        connection.reading = reading;
+        connection.writing = writing;
+    }
+}
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(static_cast<uint16_t>(port));
 
-    if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
-        ::close(listen_fd);
-        throw std::runtime_error("bind() failed (note that port 502 needs root)");
+inline bool Server::process_frames(Connection& connection)
+{
+    // Every complete frame in the buffer is handled as long as the output has room for its response;
+    // clients may pipeline requests
+    if (register_thread && (connection.output_size > 0)) {
+        return true;  // the output goes to the register thread only when empty
     }
-    if (::listen(listen_fd, 16) < 0) {
-        ::close(listen_fd);
-        throw std::runtime_error("listen() failed");
+    if (connection.deferring) {
+        return true;  // the frames behind a deferred read wait for its response
     }
-    set_nonblocking(listen_fd);
-    std::cout << "Modbus TCP server ";
-    std::cout << (data_width == DataWidth::W32 ? "(32bit mode)" : "(16bit mode)") << " ";
-    std::cout << "listening on port " << port << "\n";
-
-    std::vector<pollfd> pollfd_list;  // first one is for listen()
-    pollfd_list.push_back(pollfd{listen_fd, POLLIN, 0});
-
-    while (true) {
-        int n = ::poll(pollfd_list.data(), static_cast<nfds_t>(pollfd_list.size()), -1);
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            std::cerr << "poll() failed: continue processing\n";
-            continue;
+    if (is_ready(connection)) {
+        return true;  // waiting for its turn
+    }
+    size_t offset = 0, reserved = connection.output_size;
+    unsigned handled = 0;
+    while ((connection.size - offset >= 7) && (reserved + MAX_RESPONSE_SIZE <= output_high_water)) {
+        size_t length;
+        if (! frame_length(connection.buffer + offset, length)) {
+            return false;   // unrecoverable error -> close
         }
-
-        // new connection ([0] is the listenning port)
-        if (pollfd_list[0].revents & POLLIN) {
-            while (true) {
-                sockaddr_in client{};
-                socklen_t client_size = sizeof(client);
-                int fd = ::accept(listen_fd, reinterpret_cast<sockaddr*>(&client), &client_size);
-                if (fd < 0) {
-                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-                        break;
-                    }
-                    if (errno == EINTR) {
-                        continue;
-                    }
-                    std::cerr << "accept() failed\n";
-                    break;
-                }
-
-                set_keepalive(fd, keepalive_idle, keepalive_interval, keepalive_count);
-                set_sock_timeouts_ms(fd, /*rcv*/timeout_ms, /*snd*/timeout_ms);
-
-                char ipbuf[64];
-                ::inet_ntop(AF_INET, &client.sin_addr, ipbuf, sizeof(ipbuf));
-                std::cout << "Client connected: " << ipbuf << ":" << ntohs(client.sin_port) << "\n";
-
-                pollfd_list.push_back(pollfd{fd, POLLIN, 0});
-            }
+        if (connection.size - offset < length) {
+            break;
+        }
+        if ((connection.loop->requests_per_turn > 0) && (handled == connection.loop->requests_per_turn)) {
+            link_ready(connection);  // the rest after the other connections
+            break;
+        }
+        handled++;
+        if (register_thread) {
+            reserved += MAX_RESPONSE_SIZE;  // handled by the register thread, below
+        }
+        else {
+            handle_single_request(connection, connection.buffer + offset, length);
+            reserved = connection.output_size;
         }
+        offset += length;
+        if (connection.deferring) {
+            break;
+        }
+    }
+    
+    if (register_thread && (offset > 0)) {
+        // the buffer and the output belong to the register thread until the job completes
+        unlink_incomplete(connection);
+        connection.job_length = offset;
+        submit_job(connection);
+        return true;
+    }
+    // the rest waits for the output or a deferred read, not for the client
+    bool held_back = connection.deferring || is_ready(connection) || (reserved + MAX_RESPONSE_SIZE > output_high_water);
+    if ((offset > 0) || held_back) {
+        // the incomplete frame, if any, is a new one
+        unlink_incomplete(connection);
+        std::memmove(connection.buffer, connection.buffer + offset, connection.size - offset);
+        connection.size -= offset;
+    }
+    if ((connection.size > 0) && ! held_back && ! is_incomplete(connection)) {
+        connection.deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+        link_incomplete(connection);
+    }
+    
+    return true;
+}
 
-        // connected ports ([1:])
-        for (size_t i = 1; i < pollfd_list.size(); ) {
-            auto &pollfd = pollfd_list[i];
-            int fd = pollfd.fd;
 
-            bool close_this = false;
-            if (pollfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-                close_this = true;
-            }
+inline void Server::submit_job(Connection& connection)
+{
+    EventLoop& loop = *connection.loop;
+    connection.busy = true;
+    // the completion queue cannot overflow as long as the jobs in flight fit in it
+    if ((loop.jobs_in_flight >= 1024) || ! jobs->push(&connection)) {
+        loop.waiting.push_back(&connection);  // retried after the next round
+        return;
+    }
+    loop.jobs_in_flight++;
+    jobs_wakeup->notify();
+}
 
-            if (! close_this && (pollfd.revents & POLLIN)) {
-                try {
-                    if (!handle_single_request(fd)) {
-                        close_this = true; // timeout/close/error -> close
-                    }
-                } catch (...) {
-                    close_this = true;
-                }
-            }
 
-            if (close_this) {
-                ::close(fd);
-                pollfd_list[i] = pollfd_list.back();
-                pollfd_list.pop_back();
-                std::cout << "Client disconnected.\n";
+inline void Server::run_register_thread()
+{
+    // All the register-table accesses are made here, one job at a time
+    while (true) {
+        Connection* connection;
+        run_timers();
+        if (! jobs->pop(connection)) {
+            jobs_wakeup->prepare();
+            if (! jobs->pop(connection)) {
+                jobs_wakeup->wait(timers.empty() ? -1 : timeout_ms_until(timers.front().next));
                 continue;
             }
-            ++i;
+            jobs_wakeup->clear();
+        }
+        // the frames have been validated by process_frames()
+        for (size_t offset = 0; offset < connection->job_length; ) {
+            size_t length = 7 + get_u16(connection->buffer + offset + 4) - 1;
+            handle_single_request(*connection, connection->buffer + offset, length);
+            offset += length;
         }
+        EventLoop& loop = *connection->loop;
+        loop.completions->push(connection);
+        loop.wakeup->notify();
     }
 }
 
 
-inline void Server::set_nonblocking(int fd)
+inline void Server::complete_job(Connection& connection)
 {
-    int flags = ::fcntl(fd, F_GETFL, 0);
-    if (flags >= 0) ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    EventLoop& loop = *connection.loop;
+    loop.jobs_in_flight--;
+    connection.busy = false;
+    if (connection.close_pending) {
+        close_connection(connection);
+        return;
+    }
+    if (connection.paused) {
+        loop.poller->add(connection.fd);
+        connection.paused = false;
+        connection.reading = true;
+        connection.writing = false;
+    }
+    
+    // bytes received meanwhile follow the frames of the job
+    std::memmove(connection.buffer, connection.buffer + connection.job_length, connection.size - connection.job_length);
+    connection.size -= connection.job_length;
+    connection.job_length = 0;
+    
+    // the responses of the job are sent first: the next job waits for the output to be empty
+    if (! respond(connection)) {
+        close_connection(connection);
+    }
 }
 
 
-inline void Server::set_sock_timeouts_ms(int fd, int rcv_ms, int snd_ms)
+inline void Server::Connection::Deferred::complete(bool succeeded)
 {
-    timeval rcv{};
-    rcv.tv_sec  = rcv_ms / 1000;
-    rcv.tv_usec = (rcv_ms % 1000) * 1000;
-    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcv, sizeof(rcv));
-
-    timeval snd{};
-    snd.tv_sec  = snd_ms / 1000;
-    snd.tv_usec = (snd_ms % 1000) * 1000;
-    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &snd, sizeof(snd));
+    success = succeeded;
+    EventLoop& loop = *connection->loop;
+    loop.resumed->push(connection);  // cannot be full: see handle_single_request()
+    loop.wakeup->notify();
 }
 
 
-inline void Server::set_keepalive(int fd, int idle, int interval, int count)
+inline void Server::resume(Connection& connection)
 {
-    int yes = 1;
-    ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
-    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,  &idle,  sizeof(idle));
-    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
-    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT,   &count,   sizeof(count));
+    // A deferred read has completed: its response, then the frames behind it
+    EventLoop& loop = *connection.loop;
+    Connection::Deferred& deferred = connection.deferred;
+    loop.deferred_count--;
+    connection.deferring = false;
+    if (connection.close_pending) {
+        close_connection(connection);
+        return;
+    }
+    
+    uint8_t* resp_pdu = connection.output + connection.output_size + 7;
+    size_t resp_pdu_size;
+    if (deferred.success) {
+        resp_pdu_size = registers_response(*deferred.unit, deferred.function_code, deferred.start, deferred.count, deferred.values, resp_pdu);
+    }
+    else {
+        resp_pdu_size = exception_pdu(resp_pdu, deferred.function_code, EX_SLAVE_FAILURE);
+    }
+    finish_response(connection, deferred.transaction_id, deferred.unit_id, deferred.function_code, deferred.started, resp_pdu_size);
+    
+    // the deferred frame has been taken out of the buffer already
+    if (! respond(connection)) {
+        close_connection(connection);
+    }
 }
 
 
-inline bool Server::handle_single_request(int fd)
+inline bool Server::frame_length(const uint8_t* header, size_t& length)
 {
-    uint8_t header[7]; // MBAP: Modus Application Protocol
-    if (! read_exact(fd, header, sizeof(header))) {
-        return false;  // connection closed
-    }
-    
-    unsigned transaction_id = get_u16(&header[0]);
+    // MBAP: Modus Application Protocol
     unsigned protocol_id = get_u16(&header[2]);
-    unsigned length = get_u16(&header[4]);
-    unsigned unit_id = header[6];
-    
-    KOMOB_DEBUG(std::cerr << std::dec << "#####" << std::endl);
-    KOMOB_DEBUG(std::cerr << "RequestHeader(");
-    KOMOB_DEBUG(std::cerr << "transaction_id=" << transaction_id << ",");
-    KOMOB_DEBUG(std::cerr << "protocol_id=" << protocol_id << ",");
-    KOMOB_DEBUG(std::cerr << "length=" << length << ",");
-    KOMOB_DEBUG(std::cerr << "unitid=" << unit_id << ")" << std::endl);
-    
+    unsigned mbap_length = get_u16(&header[4]);
     if (protocol_id != 0) {
         return false;   // not Modbus protocol: -> close
     }
-    else if (length < 2) {            
+    else if (mbap_length < 2) {
         return false;   // bad Modbus packet: too short -> unrecoverable error -> close
     }
     
-    // We already read UnitID in header; remaining bytes in "len" include:
-    // UnitID(1) + PDU(...)
-    // After reading header, we still need to read PDU length=length-1 (since UnitID is already in header)
-    size_t pdu_length = length > 1 ? static_cast<size_t>(length-1) : 0;
-    if (pdu_length > 256) {            
+    // The "length" field counts UnitID(1) + PDU(...), and UnitID is the last byte of the header
+    size_t pdu_length = static_cast<size_t>(mbap_length-1);
+    if (pdu_length > 256) {
         return false;   // too large request (to prevent memory full) -> error -> close
     }
+    length = 7 + pdu_length;
     
-    std::vector<uint8_t> pdu(pdu_length);
-    if (! read_exact(fd, pdu.data(), pdu.size())) {
-        KOMOB_DEBUG(std::cerr << "ERROR: Connection closed during a request");
-        return false;  // connection closed
-    }
-    unsigned function_code = pdu.empty() ? 0 : pdu[0];
-    KOMOB_DEBUG(std::cerr << "RequestPDU(length=" << (pdu_length-1) << "+1,");
-    KOMOB_DEBUG(std::cerr << "function_code=" << function_code << ")" << std::endl);
+    return true;
+}
+
+
+inline void Server::handle_single_request(Connection& connection, const uint8_t* frame, size_t length)
+{
+    const uint8_t* header = frame;  // MBAP: Modus Application Protocol
+    unsigned transaction_id = get_u16(&header[0]);
+    unsigned unit_id = header[6];
+    
+    log(LogLevel::Trace, "RequestHeader(transaction_id=%u,protocol_id=%u,length=%u,unitid=%u)",
+        transaction_id, unsigned(get_u16(&header[2])), unsigned(get_u16(&header[4])), unit_id
+    );
+    
+    // the header has been validated in frame_length(); the PDU is not empty
+    const uint8_t* pdu = frame + 7;
+    size_t pdu_size = length - 7;
+    unsigned function_code = pdu[0];
+    log(LogLevel::Trace, "RequestPDU(length=%zu+1,function_code=%u)", pdu_size - 1, function_code);
     
-    std::vector<uint8_t> resp_pdu; // pdu[0] is function code
+    // The response PDU is built in place, after the room for its MBAP header
+    uint8_t* resp = connection.output + connection.output_size;
+    uint8_t* resp_pdu = resp + 7;  // resp_pdu[0] is function code
+    size_t resp_pdu_size;
+    auto started = Clock::now();
+    EventLoop& loop = *connection.loop;
+    Connection::Deferred* deferred = (loop.resumed && (loop.deferred_count < 1024)) ? &connection.deferred : nullptr;
     try {
-        resp_pdu = dispatch_pdu(pdu);
+        if (connection.rate_bucket && ! take_token(*connection.rate_bucket)) {
+            log(LogLevel::Trace, "Busy: over the rate limit");
+            resp_pdu_size = exception_pdu(resp_pdu, function_code, EX_SLAVE_BUSY);
+        }
+        else {
+            std::unique_lock<std::mutex> lock(access_mutex, std::defer_lock);
+            if (serialize_access) {
+                lock.lock();
+            }
+            resp_pdu_size = dispatch_pdu(unit_for(unit_id), pdu, pdu_size, resp_pdu, deferred);
+        }
     }
     catch (...) {
         // As a fallback, send "Slave Device Failure" with function|0x80 if possible
-        KOMOB_DEBUG(std::cerr << "ExceptionResponse" << std::endl);
-        resp_pdu = exception_pdu(function_code, EX_SLAVE_FAILURE);
+        log(LogLevel::Trace, "ExceptionResponse");
+        resp_pdu_size = exception_pdu(resp_pdu, function_code, EX_SLAVE_FAILURE);
     }
-    
-    // Build response header (MBAP)
-    // Response length = UnitID(1) + resp_pdu.size()
-    std::vector<uint8_t> resp;
-    resp.reserve(7 + resp_pdu.size());
-    push_u16(resp, transaction_id);
-    push_u16(resp, 0x0000); // protocol id (Modbus: 0)
-    push_u16(resp, static_cast<uint16_t>(1 + resp_pdu.size()));
-    resp.push_back(unit_id);
-    resp.insert(resp.end(), resp_pdu.begin(), resp_pdu.end());
-    
-    if (! write_exact(fd, resp.data(), resp.size())) {
-        return false;  // connection closed
+    if (resp_pdu_size == PDU_DEFERRED) {
+        // no room is taken in the output meanwhile: the response is appended when the read completes
+        deferred->transaction_id = transaction_id;
+        deferred->unit_id = unit_id;
+        deferred->started = started;
+        loop.deferred_count++;
+        return;
     }
+    finish_response(connection, transaction_id, unit_id, function_code, started, resp_pdu_size);
+}
 
-    return true;
+
+inline void Server::finish_response(Connection& connection, unsigned transaction_id, unsigned unit_id, unsigned function_code, Clock::time_point started, size_t resp_pdu_size)
+{
+    uint8_t* resp = connection.output + connection.output_size;
+    uint8_t* resp_pdu = resp + 7;
+    auto& counters = connection.loop->counters;
+    uint64_t elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - started).count());
+    count(counters.requests[function_code]);
+    count(counters.latency[ServerStats::latency_bucket(elapsed)]);
+    if (elapsed > counters.latency_max.load(std::memory_order_relaxed)) {
+        counters.latency_max.store(elapsed, std::memory_order_relaxed);
+    }
+    if (resp_pdu[0] & 0x80) {
+        count(counters.exceptions[resp_pdu[1]]);
+    }
+    
+    // Response header (MBAP)
+    // Response length = UnitID(1) + resp_pdu_size
+    put_u16(&resp[0], transaction_id);
+    put_u16(&resp[2], 0x0000); // protocol id (Modbus: 0)
+    put_u16(&resp[4], static_cast<uint16_t>(1 + resp_pdu_size));
+    resp[6] = static_cast<uint8_t>(unit_id);
+    connection.output_size += 7 + resp_pdu_size;
 }
 
 
-inline std::vector<uint8_t> Server::dispatch_pdu(const std::vector<uint8_t>& request)
+inline size_t Server::dispatch_pdu(Unit& unit, const uint8_t* request, size_t size, uint8_t* response, Connection::Deferred* deferred)
 {
-    if (request.size() < 1) {
-        return exception_pdu(0, EX_ILLEGAL_FUNCTION);
+    if (size < 1) {
+        return exception_pdu(response, 0, EX_ILLEGAL_FUNCTION);
     }
     unsigned function_code = request[0];
+    if ((&unit == &default_unit) && unit.chain.empty() && ! routed_units.empty()) {
+        return exception_pdu(response, function_code, EX_GATEWAY_PATH);  // a unit ID not routed
+    }
     
     switch (function_code) {
+      case FC_READ_COILS:
+      case FC_READ_DISCRETE_INPUTS:
+        return read_bits(unit, request, size, response);
+
       case FC_READ_HOLDING_REGISTERS:
-        return read_holding_registers(request);
+      case FC_READ_INPUT_REGISTERS:  // same layout; the input-register space of the tables
+        return read_holding_registers(unit, request, size, response, deferred);
+
+      case FC_WRITE_SINGLE_COIL:
+        return write_single_coil(unit, request, size, response);
+
+      case FC_WRITE_MULTIPLE_COILS:
+        return write_multiple_coils(unit, request, size, response);
 
       case FC_WRITE_SINGLE_REGISTER:
-        return write_single_register(request);
+        return write_single_register(unit, request, size, response);
 
       case FC_WRITE_MULTIPLE_REGISTERS:
-        return write_multiple_registers(request);
+        return write_multiple_registers(unit, request, size, response);
+
+      case FC_READ_WRITE_MULTIPLE_REGISTERS:
+        return read_write_multiple_registers(unit, request, size, response);
+
+      case FC_READ_CHANGED_BLOCKS:
+        return read_changed_blocks(unit, request, size, response);
 
       default:
-        KOMOB_DEBUG(std::cerr << "Illigal function code" << std::endl);
-        return exception_pdu(function_code, EX_ILLEGAL_FUNCTION);
+        log(LogLevel::Trace, "Illegal function code");
+        return exception_pdu(response, function_code, EX_ILLEGAL_FUNCTION);
     }
 }
 
 
-inline std::vector<uint8_t> Server::exception_pdu(uint8_t function_code, uint8_t exception_code)
+inline size_t Server::exception_pdu(uint8_t* response, uint8_t function_code, uint8_t exception_code)
 {
-    std::vector<uint8_t> out;
-    out.push_back(static_cast<uint8_t>(function_code | 0x80));
-    out.push_back(exception_code);
+    response[0] = static_cast<uint8_t>(function_code | 0x80);
+    response[1] = exception_code;
     
-    return out;
+    return 2;
+}
+
+
+inline bool Server::read_registers(Unit& unit, unsigned start, unsigned count, unsigned* values)
+{
+    return unit.chain.read(start, count, values);
+}
+
+
+inline bool Server::write_registers(Unit& unit, unsigned start, unsigned count, const unsigned* values)
+{
+    if (! unit.changes) {
+        return unit.chain.write(start, count, values);
+    }
+    // recorded after the write, also a failed one (a part of it may have been made),
+    // so that a client taking the version before reading does not miss a change
+    bool done;
+    try {
+        done = unit.chain.write(start, count, values);
+    }
+    catch (...) {
+        unit.changes->changed(start, count);
+        throw;
+    }
+    unit.changes->changed(start, count);
+    return done;
 }
 
 
-inline std::vector<uint8_t> Server::read_holding_registers(const std::vector<uint8_t>& request)
+inline size_t Server::read_holding_registers(Unit& unit, const uint8_t* request, size_t size, uint8_t* response, Connection::Deferred* deferred)
 {
-    // Request: [FC(0x03)][Start Hi][Start Lo][Qty Hi][Qty Lo]
+    // Request: [FC(0x03 or 0x04)][Start Hi][Start Lo][Qty Hi][Qty Lo]
     uint8_t function_code = request[0];  // size has been tested to be greater than 1
-    if (request.size() != 5) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);
+    if (size != 5) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
     unsigned start = static_cast<unsigned>(get_u16(&request[1]));
     unsigned quantity = static_cast<unsigned>(get_u16(&request[3]));
-    unsigned width = (data_width == DataWidth::W32) ? 2 : 1;
-    KOMOB_DEBUG(std::cerr << "ReadHoldingRegister(start=" << start << ",quantity=" << quantity << ")" << std::endl);
+    unsigned width = (unit.data_width == DataWidth::W32) ? 2 : 1;
+    log(LogLevel::Trace, "ReadHoldingRegister(start=%u,quantity=%u)", start, quantity);
     
     if (quantity % width != 0) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
-    if (quantity > 128) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);  // return byte-count is 8-bit
+    if ((quantity < 1) || (quantity > 125)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);  // return byte-count is 8-bit
     }
     
     try {
-        std::vector<uint8_t> out;
-        out.push_back(function_code);
-        out.push_back(static_cast<uint8_t>(quantity * 2)); // byte count
-        out.reserve(2 + quantity * 2);
-        KOMOB_DEBUG(std::cerr << "  OutData: ");
-        for (unsigned i = 0; i*width < quantity; i++) {
-            unsigned address = start + i, value;
-            bool handled = false;
-            for (auto& register_table: register_tables) {
-                if (register_table->read(address, value)) {
-                    handled = true;
-                    break;
-                }
-            }
-            if (handled) {
-                if (data_width == DataWidth::W32) {
-                    push_u32(out, static_cast<uint32_t>(value));
-                }
-                else {
-                    push_u16(out, static_cast<uint16_t>(value));
-                }
-                KOMOB_DEBUG(std::cerr << std::hex << "[0x" << address << "]=>0x" << value << " ");
-            }
-            else {
-                return exception_pdu(function_code, EX_ILLEGAL_ADDRESS);
+        unsigned count = quantity / width;
+        bool input = (function_code == FC_READ_INPUT_REGISTERS);
+        unsigned buffer[128];
+        unsigned* values = buffer;
+        bool found;
+        if (deferred) {
+            // set up before the offer: the table may complete at once, or from another thread
+            deferred->unit = &unit;
+            deferred->function_code = function_code;
+            deferred->start = start;
+            deferred->count = count;
+            deferred->connection->deferring = true;
+            bool taken;
+            found = unit.chain.read_async(start, count, deferred->values, input, Completion(deferred), taken);
+            if (taken) {
+                return PDU_DEFERRED;
             }
+            deferred->connection->deferring = false;
+            values = deferred->values;  // served synchronously, by the tables not taking it
+        }
+        else if (input) {
+            found = unit.chain.read_inputs(start, count, values);
+        }
+        else {
+            found = read_registers(unit, start, count, values);
+        }
+        if (! found) {
+            return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
         }
-        KOMOB_DEBUG(std::cerr << std::endl);
-        return out;
+        return registers_response(unit, function_code, start, count, values, response);
     }
     catch (...) {
-        return exception_pdu(function_code, EX_SLAVE_FAILURE);
+        if (deferred) {
+            deferred->connection->deferring = false;
+        }
+        return exception_pdu(response, function_code, EX_SLAVE_FAILURE);
+    }
+}
+
+
+inline size_t Server::registers_response(Unit& unit, uint8_t function_code, unsigned start, unsigned count, const unsigned* values, uint8_t* response)
+{
+    // Response: [FC][ByteCount][Values...]
+    unsigned quantity = (unit.data_width == DataWidth::W32) ? 2 * count : count;
+    response[0] = function_code;
+    response[1] = static_cast<uint8_t>(quantity * 2); // byte count
+    encode_registers(response + 2, values, count, unit.data_width);
+    if (logging(LogLevel::Trace)) {
+        for (unsigned i = 0; i < count; i++) {
+            log(LogLevel::Trace, "  [0x%x]=>0x%x", start + i, values[i]);
+        }
     }
+    return 2 + quantity * 2;
 }
 
+
+inline size_t Server::read_bits(Unit& unit, const uint8_t* request, size_t size, uint8_t* response)
+{
+    // Request: [FC(0x01 or 0x02)][Start Hi][Start Lo][Qty Hi][Qty Lo]
+    uint8_t function_code = request[0];  // size has been tested to be greater than 1
+    if (size != 5) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    unsigned start = static_cast<unsigned>(get_u16(&request[1]));
+    unsigned quantity = static_cast<unsigned>(get_u16(&request[3]));
+    log(LogLevel::Trace, "ReadBits(function_code=%u,start=%u,quantity=%u)", unsigned(function_code), start, quantity);
+    
+    if ((quantity < 1) || (quantity > 2000)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
     
-inline std::vector<uint8_t> Server::write_single_register(const std::vector<uint8_t>& request)
+    try {
+        uint8_t bits[2000];
+        bool found;
+        if (function_code == FC_READ_COILS) {
+            found = unit.chain.read_coils(start, quantity, bits);
+        }
+        else {
+            found = unit.chain.read_discrete_inputs(start, quantity, bits);
+        }
+        if (! found) {
+            return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
+        }
+        
+        // Response: [FC][ByteCount][Bits...], LSB first; the unused bits of the last byte are 0
+        unsigned byte_count = (quantity + 7) / 8;
+        response[0] = function_code;
+        response[1] = static_cast<uint8_t>(byte_count);
+        uint8_t* out = response + 2;
+        std::memset(out, 0, byte_count);
+        for (unsigned i = 0; i < quantity; i++) {
+            out[i / 8] |= static_cast<uint8_t>((bits[i] ? 1 : 0) << (i % 8));
+        }
+        return 2 + byte_count;
+    }
+    catch (...) {
+        return exception_pdu(response, function_code, EX_SLAVE_FAILURE);
+    }
+}
+
+
+inline size_t Server::write_single_coil(Unit& unit, const uint8_t* request, size_t size, uint8_t* response)
 {
-    // Request: [FC(0x06))[Addr Hi][Addr Lo][Val Hi][Val Lo]
+    // Request: [FC(0x05)][Addr Hi][Addr Lo][0xFF or 0x00][0x00]
     uint8_t function_code = request[0];  // size has been tested to be greater than 1
-    if (request.size() != 5) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);
+    if (size != 5) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
     unsigned address = static_cast<unsigned>(get_u16(&request[1]));
     unsigned value = static_cast<unsigned>(get_u16(&request[3]));
-    KOMOB_DEBUG(std::cerr << "WriteHoldingRegister(address=0x" << std::hex << address << ",value=0x" << value << ")" << std::endl);
+    log(LogLevel::Trace, "WriteSingleCoil(address=0x%x,value=0x%x)", address, value);
     
-    if (data_width != DataWidth::W16) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);
+    if ((value != 0xff00) && (value != 0x0000)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
 
     try {
-        bool handled = false;
-        for (auto& register_table: register_tables) {
-            if (register_table->write(address, value)) {
-                handled = true;
-                break;
-            }
+        uint8_t bit = (value == 0xff00) ? 1 : 0;
+        if (! unit.chain.write_coils(address, 1, &bit)) {
+            return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
+        }
+        std::memcpy(response, request, size);  // Response echoes the request PDU per spec
+        return size;
+    }
+    catch (...) {
+        return exception_pdu(response, function_code, EX_SLAVE_FAILURE);
+    }
+}
+
+
+inline size_t Server::write_multiple_coils(Unit& unit, const uint8_t* request, size_t size, uint8_t* response)
+{
+    // Request: [FC(0x0F)][Addr Hi][Addr Lo][Qty Hi][Qty Lo][ByteCount][Bits...]
+    uint8_t function_code = request[0];  // size has been tested to be greater than 1
+    if (size < 6) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    unsigned start = static_cast<unsigned>(get_u16(&request[1]));
+    unsigned quantity = static_cast<unsigned>(get_u16(&request[3]));
+    unsigned byte_count = static_cast<unsigned>(request[5]);
+    log(LogLevel::Trace, "WriteMultipleCoils(start=%u,quantity=%u)", start, quantity);
+    
+    if ((quantity < 1) || (quantity > 1968) || (byte_count != (quantity + 7) / 8)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    if (size != static_cast<size_t>(6 + byte_count)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    
+    try {
+        uint8_t bits[1968];
+        for (unsigned i = 0; i < quantity; i++) {
+            bits[i] = (request[6 + i / 8] >> (i % 8)) & 1;
         }
-        if (! handled) {
-            return exception_pdu(function_code, EX_ILLEGAL_ADDRESS);
+        if (! unit.chain.write_coils(start, quantity, bits)) {
+            return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
         }
-        return request;  // Response echoes the request PDU per spec
+        
+        // Response: [FC][Addr Hi][Addr Lo][Qty Hi][Qty Lo]
+        response[0] = function_code;
+        put_u16(&response[1], static_cast<uint16_t>(start));
+        put_u16(&response[3], static_cast<uint16_t>(quantity));
+        return 5;
+    }
+    catch (...) {
+        return exception_pdu(response, function_code, EX_SLAVE_FAILURE);
+    }
+}
+
+    
+inline size_t Server::write_single_register(Unit& unit, const uint8_t* request, size_t size, uint8_t* response)
+{
+    // Request: [FC(0x06))[Addr Hi][Addr Lo][Val Hi][Val Lo]
+    uint8_t function_code = request[0];  // size has been tested to be greater than 1
+    if (size != 5) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    unsigned address = static_cast<unsigned>(get_u16(&request[1]));
+    unsigned value = static_cast<unsigned>(get_u16(&request[3]));
+    log(LogLevel::Trace, "WriteHoldingRegister(address=0x%x,value=0x%x)", address, value);
+    
+    if (unit.data_width != DataWidth::W16) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+
+    try {
+        if (! write_registers(unit, address, 1, &value)) {
+            return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
+        }
+        std::memcpy(response, request, size);  // Response echoes the request PDU per spec
+        return size;
     }
     catch (...) {
-        return exception_pdu(function_code, EX_SLAVE_FAILURE);
+        return exception_pdu(response, function_code, EX_SLAVE_FAILURE);
     }
 }
 
 
-inline std::vector<uint8_t> Server::write_multiple_registers(const std::vector<uint8_t>& request) {
+inline size_t Server::write_multiple_registers(Unit& unit, const uint8_t* request, size_t size, uint8_t* response) {
     // Request:
     // [FC(0x10)][Addr Hi][Addr Lo][Qty Hi][Qty Lo][ByteCount][Values...]
     uint8_t function_code = request[0];  // size has been tested to be greater than 1
-    if (request.size() < 6) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);
+    if (size < 6) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
     unsigned start = static_cast<unsigned>(get_u16(&request[1]));
     unsigned quantity = static_cast<unsigned>(get_u16(&request[3]));
     unsigned byte_count = static_cast<unsigned>(request[5]);
-    unsigned width = (data_width == DataWidth::W32) ? 2 : 1;
-    KOMOB_DEBUG(std::cerr << "WriteMultipleRegisters(start=" << start << ",quantity=" << quantity << ")" << std::endl);
+    unsigned width = (unit.data_width == DataWidth::W32) ? 2 : 1;
+    log(LogLevel::Trace, "WriteMultipleRegisters(start=%u,quantity=%u)", start, quantity);
     
     if (byte_count != quantity * 2) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
     if (quantity % width != 0) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
-    if (request.size() != static_cast<size_t>(6 + byte_count)) {
-        return exception_pdu(function_code, EX_ILLEGAL_VALUE);
+    if (size != static_cast<size_t>(6 + byte_count)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
     
     try {
-        KOMOB_DEBUG(std::cerr << "  InData: ");
-        for (unsigned i = 0; i*width < quantity; i++) {
-            unsigned offset = 6 + 2 * i * width;
-            unsigned address = start + i, value;
-            if (data_width == DataWidth::W32) {
-                value = static_cast<unsigned>(get_u32(&request[offset]));
-            }
-            else {
-                value = static_cast<unsigned>(get_u16(&request[offset]));
-            }
-            bool handled = false;
-            for (auto& register_table: register_tables) {
-                if (register_table->write(address, value)) {
-                    handled = true;
-                    break;
-                }
-            }
-            if (handled) {
-                KOMOB_DEBUG(std::cerr << std::hex << "[0x" << address << "]<=0x" << value << " ");
-            }
-            else {
-                return exception_pdu(function_code, EX_ILLEGAL_ADDRESS);
+        unsigned count = quantity / width;
+        unsigned values[128];
+        decode_registers(values, request + 6, count, unit.data_width);
+        if (logging(LogLevel::Trace)) {
+            for (unsigned i = 0; i < count; i++) {
+                log(LogLevel::Trace, "  [0x%x]<=0x%x", start + i, values[i]);
             }
         }
-        KOMOB_DEBUG(std::cerr << std::endl);
+        if (! write_registers(unit, start, count, values)) {
+            return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
+        }
 
         // Response: [FC][Addr Hi][Addr Lo][Qty Hi][Qty Lo]
-        std::vector<uint8_t> out;
-        out.push_back(function_code);
-        push_u16(out, static_cast<uint16_t>(start));
-        push_u16(out, static_cast<uint16_t>(quantity));
-        return out;
+        response[0] = function_code;
+        put_u16(&response[1], static_cast<uint16_t>(start));
+        put_u16(&response[3], static_cast<uint16_t>(quantity));
+        return 5;
+    }
+    catch (...) {
+        return exception_pdu(response, function_code, EX_SLAVE_FAILURE);
+    }
+}
+
+
+inline size_t Server::read_write_multiple_registers(Unit& unit, const uint8_t* request, size_t size, uint8_t* response) {
+    // Request:
+    // [FC(0x17)][ReadAddr Hi][ReadAddr Lo][ReadQty Hi][ReadQty Lo]
+    //           [WriteAddr Hi][WriteAddr Lo][WriteQty Hi][WriteQty Lo][ByteCount][Values...]
+    // The write is made before the read, in the same request
+    uint8_t function_code = request[0];  // size has been tested to be greater than 1
+    if (size < 10) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    unsigned read_start = static_cast<unsigned>(get_u16(&request[1]));
+    unsigned read_quantity = static_cast<unsigned>(get_u16(&request[3]));
+    unsigned write_start = static_cast<unsigned>(get_u16(&request[5]));
+    unsigned write_quantity = static_cast<unsigned>(get_u16(&request[7]));
+    unsigned byte_count = static_cast<unsigned>(request[9]);
+    unsigned width = (unit.data_width == DataWidth::W32) ? 2 : 1;
+    log(LogLevel::Trace, "ReadWriteMultipleRegisters(read_start=%u,read_quantity=%u,write_start=%u,write_quantity=%u)",
+        read_start, read_quantity, write_start, write_quantity
+    );
+    
+    if ((byte_count != write_quantity * 2) || (size != static_cast<size_t>(10 + byte_count))) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    if ((read_quantity % width != 0) || (write_quantity % width != 0)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    if ((read_quantity < 1) || (read_quantity > 125) || (write_quantity < 1) || (write_quantity > 121)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);  // the limits of the spec
+    }
+    
+    try {
+        unsigned write_count = write_quantity / width;
+        unsigned values[128];
+        decode_registers(values, request + 10, write_count, unit.data_width);
+        if (logging(LogLevel::Trace)) {
+            for (unsigned i = 0; i < write_count; i++) {
+                log(LogLevel::Trace, "  [0x%x]<=0x%x", write_start + i, values[i]);
+            }
+        }
+        if (! write_registers(unit, write_start, write_count, values)) {
+            return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
+        }
+        
+        unsigned read_count = read_quantity / width;
+        if (! read_registers(unit, read_start, read_count, values)) {
+            return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
+        }
+        
+        // Response: [FC][ByteCount][Values...]
+        response[0] = function_code;
+        response[1] = static_cast<uint8_t>(read_quantity * 2); // byte count
+        encode_registers(response + 2, values, read_count, unit.data_width);
+        if (logging(LogLevel::Trace)) {
+            for (unsigned i = 0; i < read_count; i++) {
+                log(LogLevel::Trace, "  [0x%x]=>0x%x", read_start + i, values[i]);
+            }
+        }
+        return 2 + read_quantity * 2;
     }
     catch (...) {
-        return exception_pdu(function_code, EX_SLAVE_FAILURE);
+        return exception_pdu(response, function_code, EX_SLAVE_FAILURE);
+    }
+}
+
+
+inline size_t Server::read_changed_blocks(Unit& unit, const uint8_t* request, size_t size, uint8_t* response)
+{
+    // Request:  [FC(0x41)][Since (4)][Start Hi][Start Lo][Qty Hi][Qty Lo]
+    // Response: [FC][Version (4)][BlockSize (2)][FirstBlock (2)][ByteCount][Bitmap...]
+    // Bit i (LSB first, as for coils) is set if the block at FirstBlock + i * BlockSize changed after "Since";
+    // Start and Qty are in register-table addresses. No table is accessed.
+    uint8_t function_code = request[0];
+    if (! unit.changes) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_FUNCTION);
+    }
+    if (size != 9) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
+    }
+    uint32_t since = (uint32_t(get_u16(&request[1])) << 16) | get_u16(&request[3]);
+    unsigned start = static_cast<unsigned>(get_u16(&request[5]));
+    unsigned quantity = static_cast<unsigned>(get_u16(&request[7]));
+    log(LogLevel::Trace, "ReadChangedBlocks(since=%u,start=%u,quantity=%u)", unsigned(since), start, quantity);
+    
+    ChangeTracker& changes = *unit.changes;
+    if (quantity == 0) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);
     }
+    if (! changes.covers(start, quantity)) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_ADDRESS);
+    }
+    unsigned first_block = changes.first_block(start);
+    unsigned blocks = (start + quantity - 1 - first_block) / changes.block_size() + 1;
+    unsigned byte_count = (blocks + 7) / 8;
+    if (10 + byte_count > MAX_RESPONSE_PDU_SIZE) {
+        return exception_pdu(response, function_code, EX_ILLEGAL_VALUE);  // too many blocks for one response
+    }
+    
+    uint32_t version = changes.changed_blocks(since, start, quantity, response + 10);
+    response[0] = function_code;
+    put_u16(&response[1], static_cast<uint16_t>(version >> 16));
+    put_u16(&response[3], static_cast<uint16_t>(version));
+    put_u16(&response[5], static_cast<uint16_t>(changes.block_size()));
+    put_u16(&response[7], static_cast<uint16_t>(first_block));
+    response[9] = static_cast<uint8_t>(byte_count);
+    
+    return 10 + byte_count;
 }
 
 